@@ -0,0 +1,229 @@
+// Execution benchmark: the latency of starting a single external command through
+// process_command(), the throughput of N-stage pipelines pushing PIPE_BYTES
+// through "tr" stages, command substitution (the latency of a small $(...) and
+// how fast a big one is captured), and how many script lines per second ./slash runs, for
+// builtin lines, here-documents fed to the in-process cat and external commands
+// (SLASH overrides the binary's path). Before the script rates it checks that a
+// -j run keeps the shell state a line changes (export) for the lines after it,
+// and that the accounting record of a builtin names its redirects.
+// Built and run by "make bench"; prints one JSON object per line.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define main slash_main
+#include "../src/shell-skeleton.c"
+#undef main
+
+#define SPAWNS 2000
+#define PIPE_BYTES (256L << 20)
+#define BUILTIN_LINES 50000
+#define EXTERNAL_LINES 1000
+#define SUBSTITUTIONS 1000
+#define SUBST_BYTES (256L << 20)
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Runs one command line in this process with its stdout going to /dev/null.
+// Returns the wall time in seconds.
+static double run_line(const char *line) {
+	static arena_t arena;
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+
+	double start = now();
+	process_command(parse_command(line, &arena));
+	double elapsed = now() - start;
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	arena_reset(&arena);
+	return elapsed;
+}
+
+// Writes count copies of line into a script and times "slash script".
+// Returns lines per second, or 0 if the shell could not be run.
+static double script_rate(const char *slash, const char *line, int count) {
+	char script[] = "/tmp/slash_exec_bench.XXXXXX.sh";
+	int fd = mkstemps(script, 3);
+	if (fd == -1)
+		return 0;
+	FILE *file = fdopen(fd, "w");
+	for (int i = 0; i < count; i++)
+		fprintf(file, "%s\n", line);
+	fclose(file);
+
+	sigset_t old_mask;
+	block_sigchld(&old_mask); // the shell's SIGCHLD handler would reap it first
+	double start = now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		restore_sigmask(&old_mask);
+		int null_fd = open("/dev/null", O_RDWR);
+		dup2(null_fd, STDIN_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		execl(slash, slash, script, (char *)NULL);
+		_exit(127);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	double elapsed = now() - start;
+	restore_sigmask(&old_mask);
+	unlink(script);
+	if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return 0;
+	return count / elapsed;
+}
+
+// Writes text into a script, runs "slash [-j jobs] script" with stdout captured
+// into out (size bytes at most, NUL-terminated). Returns the exit status, -1 if
+// the shell could not be run.
+static int script_output(const char *slash, const char *jobs, const char *text, char *out, size_t size) {
+	char script[] = "/tmp/slash_exec_check.XXXXXX.sh";
+	int fd = mkstemps(script, 3);
+	if (fd == -1)
+		return -1;
+	write(fd, text, strlen(text));
+	close(fd);
+	int capture = memfd_create("exec-bench", MFD_CLOEXEC);
+
+	sigset_t old_mask;
+	block_sigchld(&old_mask);
+	pid_t pid = fork();
+	if (pid == 0) {
+		restore_sigmask(&old_mask);
+		int null_fd = open("/dev/null", O_RDONLY);
+		dup2(null_fd, STDIN_FILENO);
+		dup2(capture, STDOUT_FILENO);
+		if (jobs != NULL)
+			execl(slash, slash, "-j", jobs, script, (char *)NULL);
+		else
+			execl(slash, slash, script, (char *)NULL);
+		_exit(127);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	restore_sigmask(&old_mask);
+	unlink(script);
+
+	ssize_t len = pread(capture, out, size - 1, 0);
+	out[len > 0 ? len : 0] = 0;
+	close(capture);
+	if (pid == -1 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+// The same script must give the same output and status with and without -j.
+static int check_parallel(const char *slash, const char *text, const char *expected) {
+	char out[256];
+	const char *modes[] = { NULL, "4" };
+	for (int m = 0; m < 2; m++) {
+		int status = script_output(slash, modes[m], text, out, sizeof(out));
+		if (status != 0 || strcmp(out, expected) != 0) {
+			fprintf(stderr, "exec_bench: %s run of \"%s\" gave status %d and \"%s\"\n",
+				modes[m] ? "-j 4" : "sequential", text, status, out);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// SLASH_ACCOUNTING must log a builtin with its redirect, like an external command.
+static int check_accounting(const char *slash) {
+	char records[64], target[64], script[160], out[256], expected[160];
+	snprintf(records, sizeof(records), "/tmp/slash_exec_check.%d.acct", getpid());
+	snprintf(target, sizeof(target), "/tmp/slash_exec_check.%d.out", getpid());
+	snprintf(script, sizeof(script), "echo hi > %s\n", target);
+	snprintf(expected, sizeof(expected), "\"command\":\"echo hi > %s\"", target);
+	setenv("SLASH_ACCOUNTING", records, 1);
+	int status = script_output(slash, NULL, script, out, sizeof(out));
+	unsetenv("SLASH_ACCOUNTING");
+
+	char logged[1024] = "";
+	int fd = open(records, O_RDONLY);
+	if (fd != -1) {
+		ssize_t len = read(fd, logged, sizeof(logged) - 1);
+		logged[len > 0 ? len : 0] = 0;
+		close(fd);
+	}
+	unlink(records);
+	unlink(target);
+	if (status != 0 || strstr(logged, expected) == NULL) {
+		fprintf(stderr, "exec_bench: accounting record of \"%.*s\" is \"%s\"\n",
+			(int)strlen(script) - 1, script, logged);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	jobs_init();
+	interactive = job_control = false; // the benchmark must not take the terminal
+
+	static double samples[SPAWNS];
+	run_line("uname"); // warm up the path cache and the page cache
+	for (int i = 0; i < SPAWNS; i++)
+		samples[i] = run_line("uname");
+	qsort(samples, SPAWNS, sizeof(double), compare_doubles);
+	double sum = 0;
+	for (int i = 0; i < SPAWNS; i++)
+		sum += samples[i];
+	printf("{\"bench\":\"spawn\",\"command\":\"uname\",\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+		sum / SPAWNS * 1e6, samples[SPAWNS / 2] * 1e6, samples[SPAWNS * 99 / 100] * 1e6);
+
+	const int stage_counts[] = { 2, 4, 8 };
+	for (size_t s = 0; s < sizeof(stage_counts) / sizeof(int); s++) {
+		char line[512];
+		int len = snprintf(line, sizeof(line), "head -c %ld /dev/zero", PIPE_BYTES);
+		for (int i = 2; i < stage_counts[s]; i++)
+			len += snprintf(line + len, sizeof(line) - len, " | tr a b");
+		snprintf(line + len, sizeof(line) - len, " | wc -c");
+		double elapsed = run_line(line);
+		printf("{\"bench\":\"pipeline\",\"stages\":%d,\"bytes\":%ld,\"mb_per_s\":%.1f}\n",
+			stage_counts[s], PIPE_BYTES, PIPE_BYTES / elapsed / (1 << 20));
+	}
+
+	double start = now();
+	size_t output_len;
+	for (int i = 0; i < SUBSTITUTIONS; i++)
+		free(command_output("uname", 5, &output_len));
+	double small = (now() - start) / SUBSTITUTIONS;
+	char big_command[64];
+	int big_len = snprintf(big_command, sizeof(big_command), "head -c %ld /dev/zero", SUBST_BYTES);
+	start = now();
+	free(command_output(big_command, big_len, &output_len));
+	double big = now() - start;
+	printf("{\"bench\":\"substitution\",\"command\":\"uname\",\"mean_us\":%.1f,\"captured_bytes\":%zu,\"capture_mb_per_s\":%.1f}\n",
+		small * 1e6, output_len, output_len / big / (1 << 20));
+
+	const char *slash = getenv("SLASH") != NULL ? getenv("SLASH") : "./slash";
+	if (access(slash, X_OK) != 0) {
+		printf("{\"bench\":\"script\",\"skipped\":\"%s not found\"}\n", slash);
+		return 0;
+	}
+	if (check_parallel(slash, "export FOO=bar\nprintenv FOO\necho x\n", "bar\nx\n") || check_accounting(slash))
+		return 1;
+	printf("{\"bench\":\"script\",\"kind\":\"builtin\",\"lines\":%d,\"lines_per_s\":%.0f}\n",
+		BUILTIN_LINES, script_rate(slash, "echo benchmark line", BUILTIN_LINES));
+	printf("{\"bench\":\"script\",\"kind\":\"heredoc\",\"lines\":%d,\"lines_per_s\":%.0f}\n",
+		BUILTIN_LINES, script_rate(slash, "cat <<EOF\nkey=value\nother=1\nEOF", BUILTIN_LINES));
+	printf("{\"bench\":\"script\",\"kind\":\"external\",\"lines\":%d,\"lines_per_s\":%.0f}\n",
+		EXTERNAL_LINES, script_rate(slash, "uname", EXTERNAL_LINES));
+	return 0;
+}
@@ -0,0 +1,357 @@
+// Lexer test and benchmark. First a differential fuzz test: random simple
+// command lines (plain words, blank-separated pipes, redirects with or without
+// a blank, trailing &) must parse exactly as they did with the parser before the
+// lexer, and a few quoting cases must come out right. Then parse_line() is timed
+// on long generated lines with quotes and escapes, once per lex_find()
+// implementation (AVX2, SSE2, scalar), next to the old parser.
+// Built and run by "make bench"; prints one JSON object per line and fails if
+// the parsers disagree.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define main slash_main
+#include "../src/shell-skeleton.c"
+#undef main
+
+#define FUZZ_CASES 200000
+#define LONG_LINE_BYTES (64 * 1024)
+#define LONG_LINE_ROUNDS 2000
+
+// The parser before the lexer, kept as the reference for the fuzz test: blanks
+// split words, "|" must stand alone and quotes only come off a whole word.
+static cmd_t *old_parse_line(const char *line, int len, arena_t *arena) {
+
+	// trim whitespace from both ends
+	while (len > 0 && is_blank(line[0])) {
+		line++;
+		len--;
+	}
+	while (len > 0 && is_blank(line[len - 1]))
+		len--;
+
+	cmd_t *cmd = arena_calloc(arena, sizeof(cmd_t));
+
+	// marked for auto-complete
+	if (len > 0 && line[len - 1] == '?') cmd->auto_complete = true;	// if command ends with ? mark it for auto-complete
+
+	// background execution
+	if (len > 0 && line[len - 1] == '&') {	// if command ends with & mark it for background-execution
+		cmd->background = true;
+		len--; // drop the &, it may be glued to the last word ("sleep 5&")
+		while (len > 0 && is_blank(line[len - 1]))
+			len--;
+	}
+
+	// tokenize: one pass over a private copy of the line, cutting it at blanks
+	char *buf = arena_strndup(arena, line, len);
+	char **tokens = arena_alloc(arena, sizeof(char *) * (len / 2 + 1)); // at most one token per 2 chars
+	int token_count = 0;
+	for (int i = 0; i < len; i++) {
+		if (is_blank(buf[i])) {
+			buf[i] = 0;
+		} else if (i == 0 || buf[i - 1] == 0) {
+			tokens[token_count++] = buf + i; // start of a word
+		}
+	}
+
+	// build one command per run of tokens between "|"s
+	cmd_t *current = cmd;
+	int t = 0;
+	while (1) {
+		int stage_end = t; // the "|" ending this command, or token_count
+		while (stage_end < token_count && strcmp(tokens[stage_end], "|") != 0)
+			stage_end++;
+
+		// parse command name
+		current->name = t < stage_end ? tokens[t++] : ""; // empty name if there is no token
+		// room for the name, every argument and the terminating NULL
+		current->args = arena_alloc(arena, sizeof(char *) * (stage_end - t + 2));
+		int arg_index = 1; // args[0] is the name
+
+		for (; t < stage_end; t++) {
+			char *arg = tokens[t];
+			int arg_len = strlen(arg);
+
+			// background process; already marked in cmd
+			if (strcmp(arg, "&") == 0) continue;
+			// if the argument is "&", it is already marked earlier, skip it
+
+			// I/O redirection handling
+			// mark IO redirection
+			int redirect_index = -1;
+			if (arg[0] == '<') {
+				redirect_index = 0; // 0 -> take input from file <
+			}
+
+			if (arg[0] == '>') {
+				if (arg_len > 1 && arg[1] == '>') {
+					redirect_index = 2; // 2 -> append output to file >>
+					arg++;
+					arg_len--;
+				} else {
+					redirect_index = 1; // 1 -> write output to file >
+				}
+			}
+
+			if (redirect_index != -1) {
+				// Check if filename is included in arg -> example: >out.txt
+				if (arg_len > 1) {
+					current->redirects[redirect_index] = arg + 1; // the filename that follows the redirection symbol
+				} 
+				else { // for cases when there is space after redirection symbol -> example: > out.txt
+					if (t + 1 >= token_count) {
+						current->redirect_error = true; // process_command() prints the error
+						current->name = ""; // set command name empty
+						break;
+					}
+					current->redirects[redirect_index] = tokens[++t]; // the next word is the filename
+				}
+				continue;
+			}
+
+			// normal arguments
+			if (arg_len > 2 &&
+				((arg[0] == '"' && arg[arg_len - 1] == '"') ||
+				 (arg[0] == '\'' && arg[arg_len - 1] == '\''))) // quote wrapped arg
+			{
+				// gets rid of quotes from start and end
+				arg[--arg_len] = 0; 
+				arg++;
+			}
+
+			current->args[arg_index++] = arg; // store normal arguments
+		}
+
+		// first argument should be the name of the executable
+		// last argument should be NULL to delimit the end
+		current->args[0] = current->name;
+		current->args[arg_index] = NULL;
+		current->builtin = builtin_lookup(current->name);
+		current->arg_count = arg_index + 1; // name + arguments + NULL, like before
+
+		if (t >= token_count || strcmp(tokens[t], "|") != 0)
+			break;
+
+		// pipe handling -> the words after the "|" form the next command of the chain
+		t++;
+		current->next = arena_calloc(arena, sizeof(cmd_t));
+		current = current->next;
+	}
+
+	return cmd;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char word_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789._/-";
+
+static int append_word(char *line, int len) {
+	int word_len = 1 + rand() % 8;
+	for (int i = 0; i < word_len; i++)
+		line[len++] = word_chars[rand() % (sizeof(word_chars) - 1)];
+	return len;
+}
+
+static int append_blanks(char *line, int len) {
+	int blanks = 1 + (rand() % 4 == 0) * (rand() % 3);
+	for (int i = 0; i < blanks; i++)
+		line[len++] = rand() % 5 == 0 ? '\t' : ' ';
+	return len;
+}
+
+// A line both parsers have to agree on.
+static int simple_line(char *line) {
+	static const char *const redirects[] = { "<", ">", ">>" };
+	int len = 0;
+	if (rand() % 8 == 0)
+		len = append_blanks(line, len);
+	int stages = 1 + rand() % 4;
+	for (int s = 0; s < stages; s++) {
+		if (s > 0) {
+			len = append_blanks(line, len);
+			line[len++] = '|';
+			len = append_blanks(line, len);
+		}
+		len = append_word(line, len); // the name
+		int parts = rand() % 6;
+		for (int i = 0; i < parts; i++) {
+			len = append_blanks(line, len);
+			if (rand() % 4 == 0) {
+				const char *symbol = redirects[rand() % 3];
+				memcpy(line + len, symbol, strlen(symbol));
+				len += strlen(symbol);
+				if (rand() % 2)
+					len = append_blanks(line, len);
+			}
+			len = append_word(line, len);
+		}
+	}
+	if (rand() % 6 == 0) {
+		if (rand() % 2)
+			len = append_blanks(line, len);
+		line[len++] = '&';
+	}
+	if (rand() % 8 == 0)
+		len = append_blanks(line, len);
+	line[len] = 0;
+	return len;
+}
+
+static bool same_string(const char *a, const char *b) {
+	return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static bool same_command(cmd_t *a, cmd_t *b) {
+	for (; a != NULL && b != NULL; a = a->next, b = b->next) {
+		if (!same_string(a->name, b->name) || a->arg_count != b->arg_count || a->background != b->background ||
+			a->auto_complete != b->auto_complete || a->redirect_error != b->redirect_error || a->builtin != b->builtin)
+			return false;
+		for (int i = 0; i < a->arg_count; i++)
+			if (!same_string(a->args[i], b->args[i]))
+				return false;
+		for (int i = 0; i < 3; i++)
+			if (!same_string(a->redirects[i], b->redirects[i]))
+				return false;
+	}
+	return a == NULL && b == NULL;
+}
+
+// Quoting cases the old parser got wrong: the line and the expected words.
+static const struct {
+	const char *line;
+	const char *args[8];
+} quoting_cases[] = {
+	{ "echo \"hello world\"", { "echo", "hello world" } },
+	{ "echo 'a  b' c\\ d", { "echo", "a  b", "c d" } },
+	{ "echo \"q\\\"uote\" 'it''s' \"\\n\"", { "echo", "q\"uote", "its", "\\n" } },
+	{ "echo \"\" ''", { "echo", "", "" } },
+	{ "echo \"a|b\" 'c>d' e\\&", { "echo", "a|b", "c>d", "e&" } },
+	{ "printf x\"y z\"'w'", { "printf", "xy zw" } },
+	{ "echo '$(a b)' \"\\$(c)\" \\$(d) $ \"$\"", { "echo", "$(a b)", "$(c)", "$(d)", "$", "$" } },
+};
+
+static int check_quoting(arena_t *arena) {
+	int failures = 0;
+	for (size_t c = 0; c < sizeof(quoting_cases) / sizeof(quoting_cases[0]); c++) {
+		cmd_t *cmd = parse_command(quoting_cases[c].line, arena);
+		int i = 0;
+		while (quoting_cases[c].args[i] != NULL && same_string(cmd->args[i], quoting_cases[c].args[i]))
+			i++;
+		if (quoting_cases[c].args[i] != NULL || cmd->args[i] != NULL || cmd->next != NULL) {
+			fprintf(stderr, "lex_bench: wrong words for: %s\n", quoting_cases[c].line);
+			failures++;
+		}
+		arena_reset(arena);
+	}
+	return failures;
+}
+
+// A long line of words, quoted strings, escapes and pipes. With long_words the
+// words and quoted strings are a few hundred bytes each, like paths or data
+// passed on the command line, which is where the vector search pays off.
+static char *long_line(int size, bool long_words) {
+	char *line = malloc(size + 1024);
+	int len = 0;
+	while (len < size) {
+		if (long_words) {
+			int word_len = 100 + rand() % 400;
+			bool quoted = rand() % 2;
+			if (quoted)
+				line[len++] = '"';
+			for (int i = 0; i < word_len; i++)
+				line[len++] = quoted && rand() % 8 == 0 ? ' ' : word_chars[rand() % (sizeof(word_chars) - 1)];
+			if (quoted)
+				line[len++] = '"';
+			line[len++] = ' ';
+			continue;
+		}
+		switch (rand() % 8) {
+		case 0:
+			len += sprintf(line + len, "\"some quoted text with \\\"escapes\\\"\" ");
+			break;
+		case 1:
+			len += sprintf(line + len, "'single quoted | not a pipe' ");
+			break;
+		case 2:
+			len += sprintf(line + len, "| ");
+			break;
+		case 3:
+			len += sprintf(line + len, "back\\ slashed ");
+			break;
+		default:
+			len = append_word(line, len);
+			line[len++] = ' ';
+		}
+	}
+	line[len] = 0;
+	return line;
+}
+
+static double parse_rate(cmd_t *(*parse)(const char *, int, arena_t *), const char *line, arena_t *arena) {
+	int len = strlen(line);
+	unsigned long checksum = 0;
+	double start = now();
+	for (int r = 0; r < LONG_LINE_ROUNDS; r++) {
+		checksum += parse(line, len, arena)->arg_count;
+		arena_reset(arena);
+	}
+	double elapsed = now() - start;
+	return checksum > 0 ? (double)len * LONG_LINE_ROUNDS / elapsed / (1 << 20) : 0;
+}
+
+int main() {
+	arena_t arena = { 0 }, old_arena = { 0 };
+	char line[1024];
+	srand(1);
+
+	int mismatches = 0;
+	for (int i = 0; i < FUZZ_CASES; i++) {
+		int len = simple_line(line);
+		cmd_t *cmd = parse_line(line, len, &arena);
+		cmd_t *old = old_parse_line(line, len, &old_arena);
+		if (!same_command(cmd, old)) {
+			if (mismatches++ < 10)
+				fprintf(stderr, "lex_bench: parsers disagree on: %s\n", line);
+		}
+		arena_reset(&arena);
+		arena_reset(&old_arena);
+	}
+	int quoting_failures = check_quoting(&arena);
+	printf("{\"bench\":\"lexer_fuzz\",\"cases\":%d,\"mismatches\":%d,\"quoting_failures\":%d}\n",
+		FUZZ_CASES, mismatches, quoting_failures);
+
+	lex_init();
+	const struct {
+		const char *name;
+		const char *(*find)(const char *, const char *, int);
+		bool usable;
+	} impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+		{ "avx2", lex_find_avx2, __builtin_cpu_supports("avx2") },
+		{ "sse2", lex_find_sse2, __builtin_cpu_supports("sse2") },
+#endif
+		{ "scalar", lex_find_scalar, true },
+	};
+	for (int long_words = 0; long_words < 2; long_words++) {
+		const char *words = long_words ? "long" : "short";
+		char *text = long_line(LONG_LINE_BYTES, long_words);
+		for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+			if (!impls[i].usable)
+				continue;
+			lex_find = impls[i].find;
+			printf("{\"bench\":\"lexer\",\"impl\":\"%s\",\"words\":\"%s\",\"line_bytes\":%d,\"mb_per_s\":%.1f}\n",
+				impls[i].name, words, LONG_LINE_BYTES, parse_rate(parse_line, text, &arena));
+		}
+		printf("{\"bench\":\"lexer\",\"impl\":\"old_parser\",\"words\":\"%s\",\"line_bytes\":%d,\"mb_per_s\":%.1f}\n",
+			words, LONG_LINE_BYTES, parse_rate(old_parse_line, text, &old_arena));
+		free(text);
+	}
+	return mismatches != 0 || quoting_failures != 0;
+}
@@ -0,0 +1,167 @@
+// /proc/lsfd latency benchmark: a target process opens LSFD_BENCH_FDS (default
+// about 1M) descriptors and then keeps timing dup()/close() pairs, which take its
+// fd table lock, while we read its whole listing from /proc/lsfd. Reports the
+// target's dup/close latency with and without a reader, and the read time.
+// Built and run by "make bench"; prints one JSON object per line, and only a
+// "skipped" one when the kernel module is not loaded.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROC_PATH "/proc/lsfd"
+#define DEFAULT_FDS (1 << 20)
+#define READS 3
+
+enum { PHASE_IDLE, PHASE_READING, PHASE_DONE, PHASE_COUNT };
+
+// dup/close latency seen by the target in one phase
+typedef struct latency_t {
+	unsigned long count;
+	double sum_ns, max_ns;
+	unsigned long buckets[64]; // by log2 of the latency in ns
+} latency_t;
+
+typedef struct shared_t {
+	volatile int phase;
+	volatile long ready; // fds the target has open, -1 if it failed
+	latency_t latency[PHASE_COUNT];
+} shared_t;
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void record(latency_t *l, double ns) {
+	int bucket = 0;
+	while (bucket < 63 && (1UL << (bucket + 1)) <= ns)
+		bucket++;
+	l->buckets[bucket]++;
+	l->count++;
+	l->sum_ns += ns;
+	if (ns > l->max_ns)
+		l->max_ns = ns;
+}
+
+// Upper bound of the bucket holding the 99th percentile.
+static double p99(latency_t *l) {
+	unsigned long seen = 0;
+	for (int b = 0; b < 64; b++) {
+		seen += l->buckets[b];
+		if (seen * 100 >= l->count * 99)
+			return 2.0 * (1UL << b);
+	}
+	return 0;
+}
+
+static void target(shared_t *shared, long wanted) {
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_max < (rlim_t)wanted + 16) {
+		rl.rlim_max = wanted + 16; // works as root, up to fs.nr_open
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if ((rlim_t)wanted + 16 > rl.rlim_cur)
+		wanted = rl.rlim_cur - 16;
+
+	int fd = open("/dev/null", O_RDONLY);
+	long opened = 1;
+	while (opened < wanted && dup(fd) != -1)
+		opened++;
+	shared->ready = fd == -1 ? -1 : opened;
+
+	while (shared->phase != PHASE_DONE) {
+		int phase = shared->phase;
+		double start = now_ns();
+		int d = dup(fd);
+		close(d);
+		record(&shared->latency[phase], now_ns() - start);
+	}
+	_exit(0);
+}
+
+// Reads the whole listing of pid once. Returns the bytes read, -1 on error.
+static long read_listing(int proc_fd, pid_t pid) {
+	static char buf[1 << 20];
+	char pid_text[16];
+	int len = snprintf(pid_text, sizeof(pid_text), "%d", pid);
+	if (lseek(proc_fd, 0, SEEK_SET) == -1 || write(proc_fd, pid_text, len) != len)
+		return -1;
+	long total = 0;
+	ssize_t n;
+	while ((n = read(proc_fd, buf, sizeof(buf))) > 0)
+		total += n;
+	return n == 0 ? total : -1;
+}
+
+int main() {
+	if (access(PROC_PATH, R_OK | W_OK) != 0) {
+		printf("{\"bench\":\"lsfd\",\"skipped\":\"%s not available\"}\n", PROC_PATH);
+		return 0;
+	}
+	char *fds_env = getenv("LSFD_BENCH_FDS");
+	long wanted = fds_env != NULL && atol(fds_env) > 0 ? atol(fds_env) : DEFAULT_FDS;
+
+	shared_t *shared = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	memset(shared, 0, sizeof(shared_t));
+
+	pid_t pid = fork();
+	if (pid == 0)
+		target(shared, wanted);
+	while (shared->ready == 0)
+		usleep(1000);
+	if (shared->ready < 0) {
+		fprintf(stderr, "lsfd_bench: target could not open its descriptors\n");
+		kill(pid, SIGKILL);
+		return 1;
+	}
+
+	usleep(500000); // baseline: the target alone
+
+	int proc_fd = open(PROC_PATH, O_RDWR);
+	double best_ns = 0;
+	long bytes = 0;
+	shared->phase = PHASE_READING;
+	for (int i = 0; i < READS && proc_fd != -1; i++) {
+		double start = now_ns();
+		bytes = read_listing(proc_fd, pid);
+		double elapsed = now_ns() - start;
+		if (bytes < 0)
+			break;
+		if (best_ns == 0 || elapsed < best_ns)
+			best_ns = elapsed;
+	}
+	shared->phase = PHASE_DONE;
+	waitpid(pid, NULL, 0);
+	if (proc_fd == -1 || bytes < 0) {
+		perror("lsfd_bench: " PROC_PATH);
+		return 1;
+	}
+	close(proc_fd);
+
+	printf("{\"bench\":\"lsfd\",\"fds\":%ld,\"bytes\":%ld,\"read_ms\":%.1f", shared->ready, bytes, best_ns / 1e6);
+	const char *names[] = { "idle", "reading" };
+	for (int p = PHASE_IDLE; p <= PHASE_READING; p++) {
+		latency_t *l = &shared->latency[p];
+		printf(",\"dup_close_%s\":{\"mean_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f,\"samples\":%lu}",
+			names[p], l->count ? l->sum_ns / l->count : 0, p99(l), l->max_ns, l->count);
+	}
+	printf("}\n");
+	return 0;
+}
@@ -0,0 +1,123 @@
+// Command lookup benchmark: builds a synthetic PATH of PATH_DIRS directories with
+// EXES_PER_DIR executables each (b<dir>_<n>, 50k in all) and measures
+// resolve_path() on a cold cache (every name found only in the last directory),
+// on a warm cache and for a missing command, then tab completion: building the
+// executable index and completing a prefix with the index up to date.
+// Built and run by "make bench"; prints one JSON object per line.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define main slash_main
+#include "../src/shell-skeleton.c"
+#undef main
+
+#define PATH_DIRS 50
+#define EXES_PER_DIR 1000
+#define WARM_ROUNDS 1000
+#define COMPLETE_ROUNDS 2000
+
+static char root[] = "/tmp/slash_path_bench.XXXXXX";
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Creates the directories and empty executables, and returns the PATH value.
+static char *make_path() {
+	static char path[PATH_DIRS * 64];
+	char name[PATH_MAX];
+	path[0] = 0;
+	for (int d = 0; d < PATH_DIRS; d++) {
+		snprintf(name, sizeof(name), "%s/d%02d", root, d);
+		mkdir(name, 0755);
+		for (int e = 0; e < EXES_PER_DIR; e++) {
+			snprintf(name, sizeof(name), "%s/d%02d/b%02d_%03d", root, d, d, e);
+			int fd = open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+			if (fd != -1)
+				close(fd);
+		}
+		snprintf(path + strlen(path), sizeof(path) - strlen(path), "%s%s/d%02d", d ? ":" : "", root, d);
+	}
+	return path;
+}
+
+static void remove_path() {
+	char name[PATH_MAX];
+	for (int d = 0; d < PATH_DIRS; d++) {
+		for (int e = 0; e < EXES_PER_DIR; e++) {
+			snprintf(name, sizeof(name), "%s/d%02d/b%02d_%03d", root, d, d, e);
+			unlink(name);
+		}
+		snprintf(name, sizeof(name), "%s/d%02d", root, d);
+		rmdir(name);
+	}
+	rmdir(root);
+}
+
+int main() {
+	if (mkdtemp(root) == NULL) {
+		perror("path_bench: mkdtemp");
+		return 1;
+	}
+	setenv("PATH", make_path(), 1);
+
+	// resolve_path() and completion print to stdout, keep that out of the JSON
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	dup2(null_fd, STDOUT_FILENO);
+
+	char name[32], resolved[512];
+	unsigned long found = 0;
+
+	double start = now();
+	for (int e = 0; e < EXES_PER_DIR; e++) {
+		snprintf(name, sizeof(name), "b%02d_%03d", PATH_DIRS - 1, e);
+		found += resolve_path(name, resolved);
+	}
+	double cold = (now() - start) / EXES_PER_DIR;
+
+	start = now();
+	for (int r = 0; r < WARM_ROUNDS; r++) {
+		for (int e = 0; e < EXES_PER_DIR; e++) {
+			snprintf(name, sizeof(name), "b%02d_%03d", PATH_DIRS - 1, e);
+			found += resolve_path(name, resolved);
+		}
+	}
+	double warm = (now() - start) / ((double)WARM_ROUNDS * EXES_PER_DIR);
+
+	start = now();
+	found += resolve_path("not_a_command", resolved);
+	double missing_cold = now() - start;
+
+	start = now();
+	exe_index_sync();
+	double index_build = now() - start;
+
+	arena_t arena = { 0 };
+	start = now();
+	for (int r = 0; r < COMPLETE_ROUNDS; r++) {
+		snprintf(name, sizeof(name), "b%02d_%02d?", r % PATH_DIRS, r % 100);
+		process_command(parse_command(name, &arena));
+		arena_reset(&arena);
+	}
+	double complete = (now() - start) / COMPLETE_ROUNDS;
+
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+	close(null_fd);
+	remove_path();
+
+	printf("{\"bench\":\"resolve_path\",\"path_dirs\":%d,\"executables\":%d,\"cold_ns\":%.0f,\"warm_ns\":%.1f,"
+		"\"missing_cold_ns\":%.0f,\"found\":%lu}\n",
+		PATH_DIRS, PATH_DIRS * EXES_PER_DIR, cold * 1e9, warm * 1e9, missing_cold * 1e9, found);
+	printf("{\"bench\":\"autocomplete\",\"executables\":%d,\"index_build_ms\":%.2f,\"complete_us\":%.2f}\n",
+		exe_index_count, index_build * 1e3, complete * 1e6);
+	return 0;
+}
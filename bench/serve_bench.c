@@ -0,0 +1,153 @@
+// Server mode benchmark and end-to-end check: starts "slash --serve" on a socket
+// in /tmp, checks the answers to a few requests (status, stdout, stderr), then
+// times REQUESTS "echo" and "uname" requests over one connection against
+// running each of them with "slash -c", and checks that "exit" is answered
+// before the connection closes. SLASH overrides the shell's path.
+// Built and run by "make bench"; prints one JSON object per line.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUESTS 2000
+#define WORKERS "2"
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct reply_t {
+	int status;
+	char out[256], err[256]; // first bytes of stdout and stderr
+} reply_t;
+
+// Reads exactly len bytes, keeping the first size - 1 of them in text.
+static int read_exact(FILE *sock, size_t len, char *text, size_t size) {
+	size_t kept = 0;
+	for (size_t i = 0; i < len; i++) {
+		int c = fgetc(sock);
+		if (c == EOF)
+			return -1;
+		if (kept < size - 1)
+			text[kept++] = c;
+	}
+	text[kept] = 0;
+	return 0;
+}
+
+static int request(FILE *sock, const char *line, reply_t *reply) {
+	long long out_len, err_len;
+	double real, user, sys;
+	fprintf(sock, "%s\n", line);
+	fflush(sock);
+	// not "\n" in the format: that would wait for the next non-blank byte
+	if (fscanf(sock, "status=%d real=%lf user=%lf sys=%lf stdout=%lld stderr=%lld",
+			&reply->status, &real, &user, &sys, &out_len, &err_len) != 6 || fgetc(sock) != '\n')
+		return -1;
+	if (read_exact(sock, out_len, reply->out, sizeof(reply->out)) == -1)
+		return -1;
+	return read_exact(sock, err_len, reply->err, sizeof(reply->err));
+}
+
+static FILE *connect_server(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	for (int attempt = 0; attempt < 200; attempt++) { // the server may still be starting
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fdopen(fd, "r+");
+		close(fd);
+		usleep(10000);
+	}
+	return NULL;
+}
+
+// Starts slash with args, stdout going to /dev/null.
+static pid_t start_slash(const char *slash, char *const args[]) {
+	fflush(stdout); // the child must not write out our buffered output
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execv(slash, args);
+		_exit(127);
+	}
+	return pid;
+}
+
+static double spawn_rate(const char *slash, const char *line, int count) {
+	char *args[] = { (char *)slash, "-c", (char *)line, NULL };
+	double start = now();
+	for (int i = 0; i < count; i++)
+		waitpid(start_slash(slash, args), NULL, 0);
+	return count / (now() - start);
+}
+
+static int check(FILE *sock, const char *line, int status, const char *out, const char *err) {
+	reply_t reply;
+	if (request(sock, line, &reply) == -1 || reply.status != status || strcmp(reply.out, out) != 0 ||
+		strncmp(reply.err, err, strlen(err)) != 0) {
+		fprintf(stderr, "serve_bench: unexpected answer to \"%s\"\n", line);
+		return 1;
+	}
+	return 0;
+}
+
+int main() {
+	const char *slash = getenv("SLASH") != NULL ? getenv("SLASH") : "./slash";
+	if (access(slash, X_OK) != 0) {
+		printf("{\"bench\":\"serve\",\"skipped\":\"%s not found\"}\n", slash);
+		return 0;
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/slash_serve_bench.%d.sock", getpid());
+
+	char *args[] = { (char *)slash, "--serve", path, WORKERS, NULL };
+	pid_t server = start_slash(slash, args);
+
+	int failed = 0;
+	FILE *sock = connect_server(path);
+	if (sock == NULL) {
+		fprintf(stderr, "serve_bench: cannot connect to %s\n", path);
+		failed = 1;
+	} else {
+		failed |= check(sock, "echo hello world", 0, "hello world\n", "");
+		failed |= check(sock, "seq 1 3 | wc -l", 0, "3\n", "");
+		failed |= check(sock, "ls /nonexistent", 2, "", "ls: ");
+		failed |= check(sock, "false", 1, "", "");
+		failed |= check(sock, "not_a_command", 127, "ERROR! not_a_command: command not found\n", "");
+	}
+
+	const char *lines[] = { "echo benchmark line", "uname" };
+	for (size_t l = 0; l < 2 && !failed; l++) {
+		reply_t reply;
+		double start = now();
+		for (int i = 0; i < REQUESTS && !failed; i++)
+			failed |= request(sock, lines[l], &reply) == -1;
+		double served = REQUESTS / (now() - start);
+		printf("{\"bench\":\"serve\",\"command\":\"%s\",\"requests\":%d,\"requests_per_s\":%.0f,\"slash_c_per_s\":%.0f}\n",
+			lines[l], REQUESTS, served, spawn_rate(slash, lines[l], REQUESTS / 10));
+	}
+
+	if (sock != NULL) {
+		failed |= check(sock, "exit", 0, "", "");
+		if (fgetc(sock) != EOF) {
+			fprintf(stderr, "serve_bench: connection still open after exit\n");
+			failed = 1;
+		}
+		fclose(sock);
+	}
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return failed;
+}
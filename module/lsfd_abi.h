@@ -0,0 +1,44 @@
+// Binary interface of /proc/lsfd, shared by the kernel module and the shell.
+//
+// Instead of a decimal PID, a batch query writes a struct lsfd_batch_request
+// followed by count PIDs. Reading the same descriptor from offset 0 then returns
+// a struct lsfd_batch_header, record_count fixed-size struct lsfd_record entries
+// and a string table with the NUL-terminated paths the records point into.
+// Writing a plain PID afterwards switches the descriptor back to text output.
+#ifndef LSFD_ABI_H
+#define LSFD_ABI_H
+
+#include <linux/types.h>
+
+#define LSFD_BATCH_MAGIC 0x4466734c // "LsfD"
+#define LSFD_BATCH_MAX_PIDS 4096
+
+struct lsfd_batch_request {
+	__u32 magic; // LSFD_BATCH_MAGIC
+	__u32 count; // number of PIDs that follow
+	__s32 pids[];
+};
+
+struct lsfd_batch_header {
+	__u32 magic; // LSFD_BATCH_MAGIC
+	__u32 record_size; // sizeof(struct lsfd_record)
+	__u32 record_count;
+	__u32 strings_offset; // from the start of the header
+	__u32 strings_len;
+	__u32 reserved;
+};
+
+struct lsfd_record {
+	__s32 pid;
+	__s32 fd; // -1: no process with this PID
+	__u32 flags; // open flags (O_*)
+	__u32 path_len; // 0 if the path could not be resolved
+	__s64 pos;
+	__s64 size;
+	__u64 inode;
+	__u64 dev; // st_dev encoding, major()/minor() work on it
+	__u32 path_offset; // into the string table
+	__u32 reserved;
+};
+
+#endif
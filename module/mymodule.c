@@ -9,114 +9,403 @@
 #include <linux/uaccess.h>
 #include <linux/fs.h>
 #include <linux/fdtable.h>
+#include <linux/seq_file.h>
+#include <linux/file.h>
+#include <linux/sched/task.h>
+#include <linux/mm.h>
+#include <linux/kdev_t.h>
+#include <linux/bitops.h>
+#include <linux/rcupdate.h>
+#include <linux/version.h>
+
+#include "lsfd_abi.h"
 
 // Meta Information
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sinemis & Yamaç");
 MODULE_DESCRIPTION("COMP 304 SPRING 2025 PROJECT 1: lsfd Kernel Module");
 
-#define BUFFER_SIZE 8192 // max size of output buffer
+#define PATH_BUF_SIZE PATH_MAX // d_path() buffer, one per open of /proc/lsfd
+#define SCAN_BITS 65536 // open_fds bits looked at per task_lock() hold
 
 static struct proc_dir_entry *proc_entry; // pointer to /proc/lsfd
-static char *output_buffer;
-static size_t output_size; // current size of output buffer
-static pid_t target_pid = -1; // default PID -1
+
+// Everything one open of /proc/lsfd works with. Every opener gets its own, so
+// concurrent lsfd users never see each other's PID or output. Protocol: write a
+// PID, then read the result from offset 0 (lseek back to 0 before reading again
+// after writing another PID). The output is produced by seq_file one fd at a
+// time, so there is no limit on how many fds a process can have.
+// A binary batch query (see lsfd_abi.h) is answered from batch instead.
+struct lsfd_session {
+    pid_t pid; // -1 until a PID is written
+    struct task_struct *task; // target, referenced between start() and stop()
+    struct file *file; // file of the current fd, referenced
+    unsigned int fd; // the current fd
+    char *batch; // result of the last batch query, NULL in text mode
+    size_t batch_len;
+    char path[PATH_BUF_SIZE];
+};
 
 // Forward declarations
 static int simple_init(void);
 static void simple_exit(void);
+static int lsfd_open(struct inode *inode, struct file *file);
+static int lsfd_release(struct inode *inode, struct file *file);
 static ssize_t lsfd_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos);
+static loff_t lsfd_lseek(struct file *file, loff_t offset, int whence);
 static ssize_t lsfd_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos);
 
 
 // proc_ops struct
 static struct proc_ops fops = {
+    .proc_open = lsfd_open,
     .proc_read = lsfd_read,
+    .proc_lseek = lsfd_lseek,
     .proc_write = lsfd_write,
+    .proc_release = lsfd_release,
 };
 
-// Helper function: Build FD info for a given PID
-static void build_fd_info(pid_t pid)
+// Takes a reference on the file in an fd table slot, NULL if the slot is empty
+// or the file is being closed. Call under rcu_read_lock().
+static struct file *lsfd_get_file_rcu(struct file __rcu **slot)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+    return get_file_rcu(slot); // also makes sure the slot still holds that file
+#else
+    struct file *f = rcu_dereference(*slot);
+
+    if (f && !get_file_rcu(f))
+        f = NULL;
+    return f;
+#endif
+}
+
+// Finds the first open fd >= *fd of task and takes a reference on its file.
+// Returns NULL once there are no more open fds.
+// The target's own fd operations are never held up: files->file_lock is not
+// taken, only the set bits of the open_fds bitmap are visited under RCU, and
+// the file is pinned with a reference instead of a lock. task_lock() (which
+// keeps task->files alive) is held for at most SCAN_BITS bitmap bits at a time,
+// so even a table with millions of slots is walked in short steps.
+static struct file *lsfd_next_file(struct task_struct *task, unsigned int *fd)
 {
-    struct task_struct *task;
     struct files_struct *files;
     struct fdtable *fdt;
-    struct file *f;
-    int i;
+    struct file *f = NULL;
+    bool more = true;
+
+    while (!f && more) {
+        unsigned int end;
+
+        more = false;
+        task_lock(task); // task->files goes away under this lock when the task exits
+        rcu_read_lock();
+        files = task->files;
+        if (files) {
+            fdt = files_fdtable(files);
+            if (*fd < fdt->max_fds) {
+                end = min_t(unsigned int, fdt->max_fds, *fd + SCAN_BITS);
+                for (*fd = find_next_bit(fdt->open_fds, end, *fd); *fd < end;
+                     *fd = find_next_bit(fdt->open_fds, end, *fd + 1)) {
+                    f = lsfd_get_file_rcu(&fdt->fd[*fd]);
+                    if (f)
+                        break;
+                }
+                more = !f && end < fdt->max_fds;
+            }
+        }
+        rcu_read_unlock();
+        task_unlock(task);
+        if (more)
+            cond_resched();
+    }
+    return f;
+}
 
-	output_size = 0;
-    memset(output_buffer, 0, BUFFER_SIZE);
+// seq_file iterator: *pos is the fd number to continue from.
+static void *lsfd_seq_start(struct seq_file *m, loff_t *pos)
+{
+    struct lsfd_session *s = m->private;
+    struct pid *pid;
+
+    if (s->pid < 0 || *pos > INT_MAX)
+        return NULL;
+
+    pid = find_get_pid(s->pid);
+    s->task = get_pid_task(pid, PIDTYPE_PID);
+    put_pid(pid);
+    if (!s->task) {
+        printk(KERN_INFO "lsfd: No such process with PID %d\n", s->pid);
+        return NULL;
+    }
 
-    // Find the task_struct using PID
-    task = pid_task(find_get_pid(pid), PIDTYPE_PID);
-    if (!task) {
-        printk(KERN_INFO "lsfd: No such process with PID %d\n", pid);
-        return;
+    s->fd = *pos;
+    s->file = lsfd_next_file(s->task, &s->fd);
+    if (!s->file)
+        return NULL;
+    *pos = s->fd;
+    return s;
+}
+
+static void *lsfd_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    struct lsfd_session *s = v;
+
+    fput(s->file);
+    s->fd++;
+    s->file = lsfd_next_file(s->task, &s->fd);
+    *pos = s->fd;
+    return s->file ? s : NULL;
+}
+
+static void lsfd_seq_stop(struct seq_file *m, void *v)
+{
+    struct lsfd_session *s = m->private;
+
+    if (s->file) {
+        fput(s->file);
+        s->file = NULL;
     }
+    if (s->task) {
+        put_task_struct(s->task);
+        s->task = NULL;
+    }
+}
 
-	printk(KERN_INFO "lsfd: Found process %s (PID %d)\n", task->comm, pid);
+// One line per fd: number, file name, size and full path
+static int lsfd_seq_show(struct seq_file *m, void *v)
+{
+    struct lsfd_session *s = v;
+    struct dentry *dentry = s->file->f_path.dentry;
+    char *pathname;
+
+    pathname = d_path(&s->file->f_path, s->path, sizeof(s->path));
+    if (IS_ERR(pathname))
+        return 0; // skip it
+
+    seq_printf(m, "fd %u %s %lld bytes %s\n",
+               s->fd,
+               dentry->d_name.name,
+               i_size_read(file_inode(s->file)),
+               pathname);
+    return 0;
+}
 
-    rcu_read_lock();
-    files = task->files;
-    if (!files) {
-        rcu_read_unlock();
-        printk(KERN_INFO "lsfd: Process has no open files\n");
-        return;
+static const struct seq_operations lsfd_seq_ops = {
+    .start = lsfd_seq_start,
+    .next = lsfd_seq_next,
+    .stop = lsfd_seq_stop,
+    .show = lsfd_seq_show,
+};
+
+// Open operation: every opener gets a private session
+static int lsfd_open(struct inode *inode, struct file *file)
+{
+    struct lsfd_session *s;
+
+    // every open file counts as a user of the module, see lsfd_release()
+    if (!try_module_get(THIS_MODULE))
+        return -ENODEV;
+
+    s = __seq_open_private(file, &lsfd_seq_ops, sizeof(*s));
+    if (!s) {
+        module_put(THIS_MODULE);
+        return -ENOMEM;
     }
+    s->pid = -1;
+    return 0;
+}
 
-    spin_lock(&files->file_lock);
-    fdt = files_fdtable(files);
-
-    for (i = 0; i < fdt->max_fds; i++) {
-        f = fdt->fd[i];
-        if (f) {
-            struct dentry *dentry = f->f_path.dentry;
-            struct inode *inode = dentry->d_inode;
-            char *tmp;
-            char *pathname;
-
-            pathname = kmalloc(256, GFP_KERNEL);
-            if (!pathname)
-                continue;
-
-            tmp = d_path(&f->f_path, pathname, 256);
-            if (IS_ERR(tmp)) {
-                kfree(pathname);
-                continue;
-            }
+static int lsfd_release(struct inode *inode, struct file *file)
+{
+    struct lsfd_session *s = ((struct seq_file *)file->private_data)->private;
+    int ret;
+
+    kvfree(s->batch);
+    ret = seq_release_private(inode, file);
+    // Each shell keeps /proc/lsfd open while it runs, so the module's reference
+    // count is the number of shells using it; removing it with O_NONBLOCK only
+    // succeeds once that drops to zero. proc_remove() waits for a release that
+    // is still running, so returning into unloaded code cannot happen.
+    module_put(THIS_MODULE);
+    return ret;
+}
 
-            output_size += scnprintf(output_buffer + output_size, BUFFER_SIZE - output_size,
-                                     "fd %d %s %lld bytes %s\n",
-                                     i,
-                                     dentry->d_name.name,
-                                     inode->i_size,
-                                     tmp);
+// Growable kvmalloc'ed buffer for building a batch result
+struct lsfd_buf {
+    char *data;
+    size_t len, cap;
+};
 
-            kfree(pathname);
+static int lsfd_buf_put(struct lsfd_buf *b, const void *data, size_t len)
+{
+    if (b->len + len > b->cap) {
+        size_t cap = max3(b->cap * 2, b->len + len, (size_t)PAGE_SIZE);
+        char *grown = kvmalloc(cap, GFP_KERNEL);
+
+        if (!grown)
+            return -ENOMEM;
+        if (b->data) {
+            memcpy(grown, b->data, b->len);
+            kvfree(b->data);
         }
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// Adds one record per open fd of pid, or a single fd -1 record if there is no
+// such process.
+static int lsfd_batch_pid(struct lsfd_session *s, pid_t nr, struct lsfd_buf *records, struct lsfd_buf *strings)
+{
+    struct lsfd_record rec;
+    struct task_struct *task;
+    struct file *f;
+    struct pid *pid;
+    unsigned int fd = 0;
+    int err = 0;
+
+    pid = find_get_pid(nr);
+    task = get_pid_task(pid, PIDTYPE_PID);
+    put_pid(pid);
+    if (!task) {
+        memset(&rec, 0, sizeof(rec));
+        rec.pid = nr;
+        rec.fd = -1;
+        return lsfd_buf_put(records, &rec, sizeof(rec));
+    }
+
+    while (!err && (f = lsfd_next_file(task, &fd)) != NULL) {
+        struct inode *inode = file_inode(f);
+        char *pathname = d_path(&f->f_path, s->path, sizeof(s->path));
+
+        memset(&rec, 0, sizeof(rec));
+        rec.pid = nr;
+        rec.fd = fd;
+        rec.flags = f->f_flags;
+        rec.pos = f->f_pos;
+        rec.size = i_size_read(inode);
+        rec.inode = inode->i_ino;
+        rec.dev = huge_encode_dev(inode->i_sb->s_dev);
+        rec.path_offset = strings->len;
+        if (!IS_ERR(pathname)) {
+            rec.path_len = strlen(pathname);
+            err = lsfd_buf_put(strings, pathname, rec.path_len + 1);
+        }
+        if (!err)
+            err = lsfd_buf_put(records, &rec, sizeof(rec));
+        fput(f);
+        fd++;
+    }
+
+    put_task_struct(task);
+    return err;
+}
+
+// Answers a batch query: header, records and string table in one buffer.
+static int lsfd_build_batch(struct lsfd_session *s, const struct lsfd_batch_request *req)
+{
+    struct lsfd_batch_header header = {
+        .magic = LSFD_BATCH_MAGIC,
+        .record_size = sizeof(struct lsfd_record),
+    };
+    struct lsfd_buf records = { 0 }, strings = { 0 }, result = { 0 };
+    u32 i;
+    int err = 0;
+
+    for (i = 0; !err && i < req->count; i++)
+        err = lsfd_batch_pid(s, req->pids[i], &records, &strings);
+
+    header.record_count = records.len / sizeof(struct lsfd_record);
+    header.strings_offset = sizeof(header) + records.len;
+    header.strings_len = strings.len;
+    if (!err)
+        err = lsfd_buf_put(&result, &header, sizeof(header));
+    if (!err && records.len)
+        err = lsfd_buf_put(&result, records.data, records.len);
+    if (!err && strings.len)
+        err = lsfd_buf_put(&result, strings.data, strings.len);
+    kvfree(records.data);
+    kvfree(strings.data);
+    if (err) {
+        kvfree(result.data);
+        return err;
     }
 
-    spin_unlock(&files->file_lock);
-    rcu_read_unlock();
+    kvfree(s->batch);
+    s->batch = result.data;
+    s->batch_len = result.len;
+    return 0;
 }
 
-// Read operation: User reads from /proc/lsfd
+// Read operation: the text listing, or the result of the last batch query
 static ssize_t lsfd_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
 {
-    if (*ppos > 0 || output_size == 0)
-        return 0;
+    struct seq_file *m = file->private_data;
+    struct lsfd_session *s = m->private;
+    ssize_t ret;
+
+    mutex_lock(&m->lock);
+    if (!s->batch) {
+        mutex_unlock(&m->lock);
+        return seq_read(file, ubuf, count, ppos);
+    }
+    ret = simple_read_from_buffer(ubuf, count, ppos, s->batch, s->batch_len);
+    mutex_unlock(&m->lock);
+    return ret;
+}
 
-    if (copy_to_user(ubuf, output_buffer, output_size))
-        return -EFAULT;
+static loff_t lsfd_lseek(struct file *file, loff_t offset, int whence)
+{
+    struct seq_file *m = file->private_data;
+    struct lsfd_session *s = m->private;
 
-    *ppos = output_size;
-    return output_size;
+    if (READ_ONCE(s->batch))
+        return fixed_size_llseek(file, offset, whence, s->batch_len);
+    return seq_lseek(file, offset, whence);
+}
+
+// Batch query: struct lsfd_batch_request followed by the PIDs
+static ssize_t lsfd_write_batch(struct seq_file *m, const char __user *ubuf, size_t count)
+{
+    struct lsfd_session *s = m->private;
+    struct lsfd_batch_request *req;
+    int err;
+
+    if (count > sizeof(*req) + LSFD_BATCH_MAX_PIDS * sizeof(__s32))
+        return -E2BIG;
+
+    req = memdup_user(ubuf, count);
+    if (IS_ERR(req))
+        return PTR_ERR(req);
+
+    if (req->magic != LSFD_BATCH_MAGIC || count != sizeof(*req) + req->count * sizeof(__s32)) {
+        kfree(req);
+        return -EINVAL;
+    }
+
+    mutex_lock(&m->lock);
+    err = lsfd_build_batch(s, req);
+    mutex_unlock(&m->lock);
+    kfree(req);
+    return err ? err : count;
 }
 
 // Write operation: User writes PID into /proc/lsfd
 static ssize_t lsfd_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos)
 {
+    struct seq_file *m = file->private_data;
+    struct lsfd_session *s = m->private;
     char kbuf[16];
+    int pid;
+    u32 magic;
+
+    if (count >= sizeof(struct lsfd_batch_request) &&
+        !get_user(magic, (const u32 __user *)ubuf) && magic == LSFD_BATCH_MAGIC)
+        return lsfd_write_batch(m, ubuf, count);
 
     if (count >= sizeof(kbuf))
         return -EINVAL;
@@ -126,13 +415,21 @@ static ssize_t lsfd_write(struct file *file, const char __user *ubuf, size_t cou
 
     kbuf[count] = '\0';
 
-    if (kstrtoint(kbuf, 10, &target_pid) == 0) {
-        printk(KERN_INFO "lsfd: Received PID %d\n", target_pid);
-        build_fd_info(target_pid);
-    } else {
+    if (kstrtoint(kbuf, 10, &pid) != 0 || pid < 0) {
         printk(KERN_INFO "lsfd: Invalid PID input\n");
+        return -EINVAL;
     }
 
+    // seq_file serializes reads with m->lock, take it so a concurrent read on the
+    // same open file never sees the PID change halfway
+    mutex_lock(&m->lock);
+    s->pid = pid;
+    kvfree(s->batch); // back to text output
+    s->batch = NULL;
+    s->batch_len = 0;
+    mutex_unlock(&m->lock);
+    printk(KERN_INFO "lsfd: Received PID %d\n", pid);
+
     return count;
 }
 
@@ -147,15 +444,9 @@ int simple_init(void) {
 	printk("command: %s\n", ts->comm);
 
 
-	output_buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
-    if (!output_buffer)
-        return -ENOMEM;
-
     proc_entry = proc_create("lsfd", 0666, NULL, &fops);
-    if (!proc_entry) {
-        kfree(output_buffer);
+    if (!proc_entry)
         return -ENOMEM;
-    }
 
     printk(KERN_INFO "lsfd: Module loaded successfully.\n");
 	return 0;
@@ -165,7 +456,6 @@ int simple_init(void) {
 // A function that runs when the module is removed
 void simple_exit(void) {
 	proc_remove(proc_entry);
-    kfree(output_buffer);
 	printk(KERN_INFO "lsfd: Goodbye from the kernel\n");
 }
 
@@ -1,27 +1,60 @@
+#define _GNU_SOURCE // splice(), CLOCK_MONOTONIC_COARSE and friends
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>  // printf(), fgets()
 #include <stdlib.h> // free()
 #include <string.h> // strtok(), strcmp(), strdup()
 #include <sys/wait.h> // waitpid()
+#include <sys/resource.h> // wait4(), getrusage()
+#include <sys/time.h> // timeradd(), timersub()
 #include <termios.h> // termios, TCSANOW, ECHO, ICANON
 #include <unistd.h> // POSIX API: fork()
 #include <dirent.h> // For directory operations
 #include <fcntl.h> // for open()
 #include <sys/stat.h>   // for file modes
-#define MAX_MATCHES 256 // For the auto-complete functionality.
+#include <spawn.h> // posix_spawn()
+#include <sys/sendfile.h> // sendfile()
+#include <sys/mman.h> // mmap()
+#include <sys/uio.h> // writev()
+#include <stdint.h> // fixed width types of the script cache
+#include <limits.h> // PATH_MAX
+#include <signal.h> // sigaction(), job control
+#include <time.h> // clock_gettime(), nanosleep()
+#include <ctype.h> // isdigit() for printf and test
+#include <sys/sysmacros.h> // major(), minor()
+#include <pthread.h> // lsfd -a worker threads
+#include <sys/syscall.h> // finit_module(), delete_module()
+#include <sys/socket.h> // server mode
+#include <sys/un.h> // sockaddr_un
+#include <sys/ioctl.h> // FIONREAD
+#include <poll.h> // ppoll()
+#include "lsfd_abi.h" // binary /proc/lsfd records
 #define FILE_MODE (S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH) // Create file permissions 
 #define READ_END 0 // for pipe logic
 #define WRITE_END 1 // for pipe logic
-#define MAX_HISTORY_SIZE 140 // for history
-#define MODULE_PATH "./mymodule.ko"  // Path to the kernel module
+#define DEFAULT_HISTORY_SIZE 100000 // for history, SLASH_HISTSIZE overrides it
+#define HISTORY_FILE ".slash_history" // in $HOME, SLASH_HISTFILE overrides it
+#define MODULE_PATH "./module/mymodule.ko"  // Path to the kernel module
+#define MODULE_NAME "mymodule"
 #define PROC_PATH "/proc/lsfd" 
+#define SERVE_DEFAULT_WORKERS 4 // slash --serve without a worker count
 
 const char *sysname = "ˢˡᵃsh"; 
+bool running_script = false; // commands come from a script file, not the prompt
 
 char autocomplete_buf[512] = {0};
 
-char history[MAX_HISTORY_SIZE][512]; // stores 140 rows of previous commands
+// Command history: a ring buffer of the newest history_capacity commands. An entry
+// points either into the mmap'ed history file or to a heap copy made for a line
+// typed in this session, and is never moved once it is in the ring.
+typedef struct history_entry_t {
+	const char *line; // not NUL-terminated when it points into the file
+	size_t len;
+} history_entry_t;
+
+history_entry_t *history_ring = NULL;
+size_t history_capacity = 0;
+size_t history_start = 0; // ring index of the oldest entry
 int history_count = 0; 
 int history_idx = -1; 
 
@@ -39,215 +72,895 @@ typedef struct cmd_t {
 	int arg_count;  //  how many arguments are there
 	char **args;  // pointer to char pointers for each argument
 	char *redirects[3]; // stdin/stdout to/from file
+	bool redirect_error; // a redirect symbol without a file name, reported when the command runs
+	char *here_doc; // stdin text from a <<WORD here-document or a <<<word here-string
+	char *here_end; // WORD of a here-document whose lines are still to be read, see heredoc_read()
+	char *source; // text of a line with $(...), kept in its first command for expand_command()
+	int builtin; // BUILTIN_* id of name, looked up once by the parser
 	struct cmd_t *next; // for piping
 } cmd_t;
 
 
 void process_command(cmd_t *cmd);
+bool resolve_path(const char* cmd_name, char* path_result);
+void path_cache_clear();
+void path_cache_chdir();
+void path_cache_print();
+void jobs_init();
+void jobs_notify();
+int run_script_parallel(char *file_name, int max_jobs);
+char *command_output(const char *command, size_t len, size_t *output_len);
+int serve(const char *socket_path, int worker_count);
+extern int last_status;
+
+// FNV-1a string hash, good enough for command names and paths
+static unsigned int hash_string(const char *str) {
+	unsigned int h = 2166136261u;
+	while (*str) {
+		h ^= (unsigned char)*str++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Per-line memory arena. Everything parse_command() builds for a line (the cmd_t
+// chain, the argument arrays and the token strings) is carved out of it, and all
+// of it is released at once by arena_reset() when the line is done. The blocks
+// are kept for the next line, so in steady state parsing does not call malloc.
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct arena_block_t {
+	struct arena_block_t *next;
+	size_t size, used;
+	char data[];
+} arena_block_t;
 
-// Release allocated memory for a command structure
-void free_command(cmd_t *cmd) {
-    // if arg count is greater than 0 free command args
-	if (cmd->arg_count) {
-		for (int i = 0; i < cmd->arg_count; ++i)
-			free(cmd->args[i]);
-		free(cmd->args);
+typedef struct arena_t {
+	arena_block_t *head, *current;
+} arena_t;
+
+void *arena_alloc(arena_t *arena, size_t size) {
+	size = (size + 15) & ~(size_t)15; // keep everything 16-byte aligned
+
+	arena_block_t *block = arena->current;
+	while (block != NULL && block->used + size > block->size) {
+		if (block->next == NULL)
+			break;
+		block = block->next; // blocks after current are empty since the last reset
 	}
 
-    // free if redirects are not null
-	for (int i = 0; i < 3; ++i) {
-		if (cmd->redirects[i])
-			free(cmd->redirects[i]);
+	if (block == NULL || block->used + size > block->size) {
+		size_t block_size = ARENA_BLOCK_SIZE;
+		if (block != NULL && block->size * 2 > block_size)
+			block_size = block->size * 2;
+		if (size > block_size)
+			block_size = size;
+		arena_block_t *fresh = malloc(sizeof(arena_block_t) + block_size);
+		fresh->next = NULL;
+		fresh->size = block_size;
+		fresh->used = 0;
+		if (block == NULL)
+			arena->head = fresh;
+		else
+			block->next = fresh;
+		block = fresh;
 	}
 
-    // free if next command in pipe chain is not null
-	if (cmd->next) {
-		free_command(cmd->next);
-		cmd->next = NULL;
+	arena->current = block;
+	void *ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
+
+void *arena_calloc(arena_t *arena, size_t size) {
+	return memset(arena_alloc(arena, size), 0, size);
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+	char *copy = arena_alloc(arena, len + 1);
+	memcpy(copy, str, len);
+	copy[len] = 0;
+	return copy;
+}
+
+// Releases everything allocated from the arena, keeping the memory for reuse.
+void arena_reset(arena_t *arena) {
+	for (arena_block_t *block = arena->head; block != NULL; block = block->next)
+		block->used = 0;
+	arena->current = arena->head;
+}
+
+// The history file is append-only: every command is written to it with a single
+// write() as soon as it is entered. Reading it back is lazy; it is only mmap'ed
+// when the history is first looked at (Up/Down or the history builtin).
+static int history_fd = -1;
+static bool history_loaded = false;
+static char *history_map = NULL;
+static size_t history_map_len = 0;
+
+static const char *history_file_path() {
+	static char path[512];
+	if (path[0] == 0) {
+		char *file = getenv("SLASH_HISTFILE");
+		char *home = getenv("HOME");
+		if (file != NULL)
+			snprintf(path, sizeof(path), "%s", file);
+		else if (home != NULL)
+			snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
 	}
+	return path[0] ? path : NULL;
+}
 
-    // free the char array for name
-	free(cmd->name);
-	free(cmd);
+static void history_init() {
+	if (history_ring != NULL)
+		return;
+	char *size = getenv("SLASH_HISTSIZE");
+	history_capacity = size != NULL && atol(size) > 0 ? (size_t)atol(size) : DEFAULT_HISTORY_SIZE;
+	history_ring = calloc(history_capacity, sizeof(history_entry_t)); // untouched pages cost nothing
 }
 
+// The i-th oldest entry, 0 <= i < history_count.
+static history_entry_t *history_entry(int i) {
+	return &history_ring[(history_start + i) % history_capacity];
+}
 
+static void history_release(history_entry_t *e) {
+	bool in_map = e->line >= history_map && e->line < history_map + history_map_len;
+	if (!in_map)
+		free((char *)e->line);
+	e->line = NULL;
+}
 
-// Show the command prompt
-void show_prompt() {
-	char cwd[512], hostname[512];
-	gethostname(hostname, sizeof(hostname));
-	getcwd(cwd, sizeof(cwd));
-	printf("👤%s 💻%s 📂%s %s ╰┈➤ ", getenv("USER"), hostname, cwd, sysname);
+// O(1): when the ring is full the oldest entry is overwritten.
+static void history_push(const char *line, size_t len) {
+	history_entry_t *e;
+	if ((size_t)history_count < history_capacity) {
+		e = history_entry(history_count++);
+	} else {
+		e = &history_ring[history_start];
+		history_release(e);
+		history_start = (history_start + 1) % history_capacity;
+	}
+	e->line = line;
+	e->len = len;
+}
+
+// Adds a command typed in this session and appends it to the history file.
+void history_add(const char *line) {
+	history_init();
+	size_t len = strlen(line);
+	history_push(strndup(line, len), len);
+	history_idx = history_count; // update history browsing index to point to most recend command
+
+	if (history_fd == -1 && history_file_path() != NULL)
+		history_fd = open(history_file_path(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (history_fd != -1) {
+		struct iovec iov[2] = { { (void *)line, len }, { "\n", 1 } };
+		writev(history_fd, iov, 2); // O_APPEND keeps concurrent shells from interleaving lines
+	}
 }
 
+// Copies the i-th oldest entry into the line editor's buffer.
+static void history_copy(int i, char *buf, size_t size) {
+	history_entry_t *e = history_entry(i);
+	size_t len = e->len < size - 1 ? e->len : size - 1;
+	memcpy(buf, e->line, len);
+	buf[len] = 0;
+}
 
-// Parse a command string into a command struct
-void parse_command(char *buf, cmd_t *cmd) {
-	const char *splitters = " \t"; // split at space and tab -> define space and tab as seperators
-	int index, len;
-	len = strlen(buf); // get length of input string
+// Maps the history file and fills the ring with its newest lines. The file also
+// holds everything typed so far in this session, so those entries are replaced.
+void history_load() {
+	if (history_loaded)
+		return;
+	history_loaded = true;
+	history_init();
 
-	// trim left whitespace
-	while (len > 0 && strchr(splitters, buf[0]) != NULL) {
-		buf++;
-		len--;
+	const char *path = history_file_path();
+	int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd == -1)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			// walk back from the end to find where the newest history_capacity lines start
+			char *start = map, *end = map + st.st_size, *p = end;
+			size_t lines = 0;
+			if (p[-1] == '\n')
+				p--; // the last line's newline
+			while (p > map) {
+				char *nl = memrchr(map, '\n', p - map);
+				if (++lines == history_capacity) {
+					start = nl ? nl + 1 : map;
+					break;
+				}
+				if (nl == NULL)
+					break;
+				p = nl;
+			}
+
+			for (int i = 0; i < history_count; i++)
+				history_release(history_entry(i));
+			history_count = 0;
+			history_start = 0;
+			history_map = map;
+			history_map_len = st.st_size;
+
+			for (char *line = start; line < end; ) {
+				char *nl = memchr(line, '\n', end - line);
+				size_t len = nl ? (size_t)(nl - line) : (size_t)(end - line);
+				if (len > 0)
+					history_push(line, len);
+				line += len + 1;
+			}
+		}
+	}
+	close(fd);
+	history_idx = history_count;
+}
+
+// Line editor output. Everything one key changes on the screen is composed in
+// term_out and sent with a single write() before the next key is read, so
+// redrawing a long history entry costs one write instead of three putchar()s
+// per erased character.
+static char term_out[8192];
+static size_t term_out_len = 0;
+
+static void term_flush() {
+	for (size_t done = 0; done < term_out_len; ) {
+		ssize_t n = write(STDOUT_FILENO, term_out + done, term_out_len - done);
+		if (n <= 0 && errno != EINTR)
+			break;
+		if (n > 0)
+			done += n;
+	}
+	term_out_len = 0;
+}
+
+static void term_put(const char *str, size_t len) {
+	while (len > 0) {
+		if (term_out_len == sizeof(term_out))
+			term_flush();
+		size_t chunk = sizeof(term_out) - term_out_len < len ? sizeof(term_out) - term_out_len : len;
+		memcpy(term_out + term_out_len, str, chunk);
+		term_out_len += chunk;
+		str += chunk;
+		len -= chunk;
 	}
+}
 
-    // trim right whitespace
-	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0;
+static void term_puts(const char *str) {
+	term_put(str, strlen(str));
+}
 
-	// marked for auto-complete
-	if (len > 0 && buf[len - 1] == '?') cmd->auto_complete = true;	// if command ends with ? mark it for auto-complete
+// Replaces the old_len characters before the cursor with text: cursor back,
+// the new text, and clear whatever is left of the old one.
+static void term_replace(size_t old_len, const char *text) {
+	char seq[32];
+	if (old_len > 0) {
+		snprintf(seq, sizeof(seq), "\x1b[%zuD", old_len);
+		term_puts(seq);
+	}
+	term_puts(text);
+	term_puts("\x1b[K");
+}
 
-	// background execution
-	if (len > 0 && buf[len - 1] == '&')	cmd->background = true;	// if command ends with & mark it for background-execution
+// Terminal modes. The settings are read once; the terminal is put into
+// non-canonical, no-echo mode for the line editor and stays that way between
+// lines. It only goes back to the original (cooked) settings while a
+// foreground job owns the terminal, since programs like cat expect them.
+static struct termios cooked_termios, raw_termios;
+static int termios_state = -1; // -1 not read yet, 0 no terminal, 1 read
+static bool term_is_raw = false;
+
+// Restores the original settings; also registered with atexit().
+void term_cooked() {
+	if (term_is_raw) {
+		// MUST restore the old settings, or the terminal stays broken for everybody
+		tcsetattr(STDIN_FILENO, TCSANOW, &cooked_termios);
+		term_is_raw = false;
+	}
+}
 
-	// parse command name
-	char *pch = strtok(buf, splitters); // get the first token
-	if (pch == NULL) { // if token is empty create an empty name
-		cmd->name = (char *)malloc(1);
-		cmd->name[0] = 0;
-	} else { // alloc memory and copy the command name
-		cmd->name = (char *)malloc(strlen(pch) + 1);
-		strcpy(cmd->name, pch);
+static void term_raw() {
+	if (termios_state == -1) {
+		// tcgetattr gets the parameters of the current terminal
+		termios_state = tcgetattr(STDIN_FILENO, &cooked_termios) == 0;
+		raw_termios = cooked_termios;
+		// ICANON : canonical mode: normally takes care that one line at a time will be processed
+		// that means it will return if it sees a "\n" or an EOF or an EOL
+		raw_termios.c_lflag &= ~(ICANON | ECHO); // disable canonical mode and disable automatic echo
+		if (termios_state == 1)
+			atexit(term_cooked);
+	}
+	if (termios_state == 1 && !term_is_raw) {
+		// TCSANOW tells tcsetattr to change attributes immediately.
+		tcsetattr(STDIN_FILENO, TCSANOW, &raw_termios);
+		term_is_raw = true;
 	}
+}
 
-	cmd->args = (char **)malloc(sizeof(char *)); // init arguments array
+// The prompt is built once and reused. It only depends on the user, the host
+// name and the directory, so it is rebuilt after a cd or an environment change
+// (prompt_invalidate()) instead of asking the system for them on every line.
+static char prompt_text[2048];
+static bool prompt_valid = false;
 
-	int redirect_index; // for tracking redirections
-	int arg_index = 0; // for tracking argument indices
-	char temp_buf[1024], *arg; // for temporary buffers-> temp_buf: temp space to hold a word, arg: pointer that will point inside temp_buf
+void prompt_invalidate() {
+	prompt_valid = false;
+}
 
-	while (1) { // iteratively continue tokenizing 
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters); // NULL tells strtok to continue from where you left off
-		if (!pch) break; // breaks when there are no more token
+// Show the command prompt
+void show_prompt() {
+	if (!prompt_valid) {
+		char cwd[512], hostname[512];
+		gethostname(hostname, sizeof(hostname));
+		getcwd(cwd, sizeof(cwd));
+		snprintf(prompt_text, sizeof(prompt_text), "👤%s 💻%s 📂%s %s ╰┈➤ ", getenv("USER"), hostname, cwd, sysname);
+		prompt_valid = true;
+	}
+	term_puts(prompt_text);
+}
 
-		arg = temp_buf; 
-		strcpy(arg, pch); // copy token to temporary buffer
-		len = strlen(arg);
 
-		// trim whitespaces from both ends of the token
-		// trim left whitespace
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) { 
-			arg++;
-			len--;
+// Builtin commands. The parser looks every command name up once and stores the
+// id in cmd_t, so process_command() dispatches through a table indexed by it
+// instead of comparing the name against every builtin. Ids from
+// BUILTIN_FIRST_UTILITY on also exist as programs; they run in the shell only as
+// a single foreground command (see process_command()).
+enum {
+	BUILTIN_NONE,
+	BUILTIN_EXIT, BUILTIN_CD, BUILTIN_HISTORY, BUILTIN_HASH, BUILTIN_LSFD,
+	BUILTIN_JOBS, BUILTIN_FG, BUILTIN_BG, BUILTIN_WAIT, BUILTIN_EXPORT, BUILTIN_TIME,
+	BUILTIN_FIRST_UTILITY,
+	BUILTIN_ECHO = BUILTIN_FIRST_UTILITY, BUILTIN_PRINTF, BUILTIN_PWD, BUILTIN_TRUE,
+	BUILTIN_FALSE, BUILTIN_TEST, BUILTIN_SLEEP, BUILTIN_CAT,
+	BUILTIN_COUNT
+};
+
+static const struct {
+	const char *name;
+	int id;
+} builtin_names[] = {
+	{ "exit", BUILTIN_EXIT }, { "cd", BUILTIN_CD }, { "history", BUILTIN_HISTORY },
+	{ "hash", BUILTIN_HASH }, { "lsfd", BUILTIN_LSFD }, { "jobs", BUILTIN_JOBS },
+	{ "fg", BUILTIN_FG }, { "bg", BUILTIN_BG }, { "wait", BUILTIN_WAIT },
+	{ "export", BUILTIN_EXPORT }, { "time", BUILTIN_TIME }, { "echo", BUILTIN_ECHO },
+	{ "printf", BUILTIN_PRINTF },
+	{ "pwd", BUILTIN_PWD }, { "true", BUILTIN_TRUE }, { "false", BUILTIN_FALSE },
+	{ "test", BUILTIN_TEST }, { "[", BUILTIN_TEST }, { "sleep", BUILTIN_SLEEP },
+	{ "cat", BUILTIN_CAT },
+};
+
+// Open addressing over builtin_names; with a few times more buckets than names a
+// lookup is one hash and about one strcmp().
+#define BUILTIN_BUCKETS 64 // must be a power of two
+static unsigned char builtin_buckets[BUILTIN_BUCKETS]; // index into builtin_names + 1, 0 if empty
+
+int builtin_lookup(const char *name) {
+	static bool built = false;
+	if (!built) {
+		for (size_t i = 0; i < sizeof(builtin_names) / sizeof(builtin_names[0]); i++) {
+			unsigned int b = hash_string(builtin_names[i].name) & (BUILTIN_BUCKETS - 1);
+			while (builtin_buckets[b] != 0)
+				b = (b + 1) & (BUILTIN_BUCKETS - 1);
+			builtin_buckets[b] = i + 1;
 		}
+		built = true;
+	}
+	for (unsigned int b = hash_string(name) & (BUILTIN_BUCKETS - 1); builtin_buckets[b] != 0; b = (b + 1) & (BUILTIN_BUCKETS - 1))
+		if (strcmp(builtin_names[builtin_buckets[b] - 1].name, name) == 0)
+			return builtin_names[builtin_buckets[b] - 1].id;
+	return BUILTIN_NONE;
+}
 
-		// trim right whitespace
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) 
-			arg[--len] = 0;
-		
+static bool is_blank(char c) {
+	return c == ' ' || c == '\t';
+}
 
-		// empty arg, go for next
-		if (len == 0) continue; // skips empty argument
-		
+// Lexer. A line is scanned once, left to right, into a flat array of tokens:
+// words, with quotes and backslashes already applied, and the operators
+// | < > >> << <<< &. Outside quotes a backslash keeps the next character literal;
+// '...' keeps everything literal; in "..." a backslash only escapes " \ $ and `.
+// Operators need no blanks around them ("a|b>out" is five tokens). The bytes
+// between two special characters are found and copied in bulk: lex_find()
+// compares 32 (AVX2) or 16 (SSE2) bytes at a time against the special
+// characters of the current state, with a table-driven scalar fallback.
+// $(...) is command substitution, unquoted or in "...", see lex_subst_t.
+enum { TOKEN_WORD, TOKEN_PIPE, TOKEN_IN, TOKEN_OUT, TOKEN_APPEND, TOKEN_AMP, TOKEN_HEREDOC, TOKEN_HERESTRING };
+
+typedef struct token_t {
+	char *text; // NUL-terminated word, or the operator itself
+	int kind;
+} token_t;
+
+// The characters that end a plain run of bytes in each lexer state.
+enum { LEX_PLAIN, LEX_DQUOTE, LEX_SQUOTE, LEX_STATES };
+static const char *const lex_specials[LEX_STATES] = { " \t'\"\\|<>&$", "\"\\$", "'" };
+
+static unsigned char lex_class[256]; // bit s set for the specials of state s
+
+static const char *lex_find_scalar(const char *p, const char *end, int state) {
+	while (p < end && !(lex_class[(unsigned char)*p] & (1 << state)))
+		p++;
+	return p;
+}
 
-		// pipe handling -> if the argument is a pipe symbol "|", recursively parse the remaining command 
-		// mark for piping to another command
-		if (strcmp(arg, "|") == 0) { 
-            cmd_t *c = malloc(sizeof( cmd_t)); // create a new command structure for the command after pipe
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t')
-				index++; // skip whitespaces
-
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
-			cmd->next = c; // link c to current command
-			continue;
-		}
+// Most words are short: look at the first LEX_PROBE bytes one at a time before
+// setting up the vector search.
+#define LEX_PROBE 16
 
-		// background process handling
-		// background process; already marked in cmd
-		if (strcmp(arg, "&") == 0) continue;
-		// if the argument is "&", it is already marked earlier, skip it
-		
+static const char *lex_probe(const char *p, const char *end, int state) {
+	const char *probe_end = end - p > LEX_PROBE ? p + LEX_PROBE : end;
+	return lex_find_scalar(p, probe_end, state);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static const char *lex_find_sse2(const char *p, const char *end, int state) {
+	const char *specials = lex_specials[state];
+	p = lex_probe(p, end, state);
+	if (p == end || lex_class[(unsigned char)*p] & (1 << state))
+		return p;
+	while (end - p >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)p);
+		__m128i hits = _mm_setzero_si128();
+		for (const char *c = specials; *c; c++)
+			hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, _mm_set1_epi8(*c)));
+		unsigned int mask = _mm_movemask_epi8(hits);
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+	return lex_find_scalar(p, end, state);
+}
+
+__attribute__((target("avx2")))
+static const char *lex_find_avx2(const char *p, const char *end, int state) {
+	const char *specials = lex_specials[state];
+	p = lex_probe(p, end, state);
+	if (p == end || lex_class[(unsigned char)*p] & (1 << state))
+		return p;
+	while (end - p >= 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)p);
+		__m256i hits = _mm256_setzero_si256();
+		for (const char *c = specials; *c; c++)
+			hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(*c)));
+		unsigned int mask = _mm256_movemask_epi8(hits);
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+	return lex_find_sse2(p, end, state);
+}
+#endif
+
+static const char *(*lex_find)(const char *p, const char *end, int state) = NULL;
+
+static void lex_init() {
+	for (int state = 0; state < LEX_STATES; state++)
+		for (const char *c = lex_specials[state]; *c; c++)
+			lex_class[(unsigned char)*c] |= 1 << state;
+	lex_find = lex_find_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		lex_find = lex_find_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		lex_find = lex_find_sse2;
+#endif
+}
 
-		// I/O redirection handling
-		// mark IO redirection
-		redirect_index = -1;
-		if (arg[0] == '<') {
-			redirect_index = 0; // 0 -> take input from file <
+// What lex_line() does with a $(...). The parser keeps the text as it is and
+// only notes that the line has one: the commands must run each time the line
+// runs, not when a script is parsed. expand_command() then lexes the line twice
+// more, first running every substitution in order and keeping its output, then
+// putting the output in place of the $(...): split into words at blanks and
+// newlines, or as part of one word inside "...".
+enum { SUBST_KEEP, SUBST_RUN, SUBST_INSERT };
+
+typedef struct lex_subst_t {
+	int mode;
+	bool found; // the line has a $(...)
+	char **outputs; // SUBST_RUN fills these in order, SUBST_INSERT uses them
+	size_t *lengths;
+	int count, capacity, next;
+	size_t total; // bytes in all outputs
+} lex_subst_t;
+
+// The ) closing a $( whose text starts at p, or end if it is missing. Quotes
+// and nested parentheses, as in $(echo $(pwd) ")"), do not close it.
+static const char *subst_close(const char *p, const char *end) {
+	int depth = 1;
+	for (; p < end; p++) {
+		if (*p == '\\' && p + 1 < end) {
+			p++;
+		} else if (*p == '\'') {
+			const char *quote = memchr(p + 1, '\'', end - p - 1);
+			p = quote != NULL ? quote : end - 1;
+		} else if (*p == '"') {
+			while (++p < end && *p != '"')
+				if (*p == '\\' && p + 1 < end)
+					p++;
+			if (p == end)
+				break;
+		} else if (*p == '(') {
+			depth++;
+		} else if (*p == ')' && --depth == 0) {
+			return p;
 		}
+	}
+	return end;
+}
 
-		if (arg[0] == '>') {
-			if (len > 1 && arg[1] == '>') {
-				redirect_index = 2; // 2 -> append output to file >>
-				arg++;
-				len--;
-			} else {
-				redirect_index = 1; // 1 -> write output to file >
+static void subst_add(lex_subst_t *subst, char *output, size_t len) {
+	if (subst->count == subst->capacity) {
+		subst->capacity = subst->capacity ? subst->capacity * 2 : 4;
+		subst->outputs = realloc(subst->outputs, sizeof(char *) * subst->capacity);
+		subst->lengths = realloc(subst->lengths, sizeof(size_t) * subst->capacity);
+	}
+	subst->outputs[subst->count] = output;
+	subst->lengths[subst->count++] = len;
+	subst->total += len;
+}
+
+// A $(...) in lex_line(), from its $ to close (the ")" or the end of the
+// line), added to the word being built or, for SUBST_INSERT unquoted, to as
+// many words as the output has.
+static void lex_substitution(lex_subst_t *subst, const char *start, const char *close, const char *end, bool quoted,
+	char **out, token_t *tokens, int *count, bool *in_word) {
+	const char *text = start;
+	size_t text_len = (close < end ? close + 1 : end) - start;
+	if (subst->mode == SUBST_RUN) {
+		size_t output_len;
+		char *output = command_output(start + 2, close - (start + 2), &output_len);
+		subst_add(subst, output, output_len);
+	} else if (subst->mode == SUBST_INSERT) {
+		text = subst->next < subst->count ? subst->outputs[subst->next] : "";
+		text_len = subst->next < subst->count ? subst->lengths[subst->next++] : 0;
+	}
+	subst->found = true;
+	bool split = subst->mode == SUBST_INSERT && !quoted;
+
+	for (size_t i = 0; i < text_len; i++) {
+		if (split && (text[i] == ' ' || text[i] == '\t' || text[i] == '\n')) {
+			if (*in_word) { // a field ends
+				*(*out)++ = 0;
+				(*count)++;
+				*in_word = false;
 			}
+			continue;
+		}
+		if (!*in_word) {
+			tokens[*count].text = *out;
+			tokens[*count].kind = TOKEN_WORD;
+			*in_word = true;
+		}
+		if (!split) { // all of it goes into this word
+			memcpy(*out, text + i, text_len - i);
+			*out += text_len - i;
+			break;
+		}
+		*(*out)++ = text[i];
+	}
+}
+
+// Splits line into tokens allocated from arena. Returns the token count; an
+// unterminated quote runs to the end of the line.
+int lex_line(const char *line, int len, arena_t *arena, token_t **tokens_out, lex_subst_t *subst) {
+	if (lex_find == NULL)
+		lex_init();
+	const char *p = line, *end = line + len;
+	size_t inserted = subst->mode == SUBST_INSERT ? subst->total : 0; // every byte can be a word
+	char *out = arena_alloc(arena, len + 1 + len / 2 + 1 + 2 * inserted); // words only shrink, plus a NUL per word
+	token_t *tokens = arena_alloc(arena, sizeof(token_t) * (len + 1 + inserted));
+	int count = 0;
+	bool in_word = false;
+
+#define WORD_START() do { if (!in_word) { tokens[count].text = out; tokens[count].kind = TOKEN_WORD; in_word = true; } } while (0)
+#define WORD_END() do { if (in_word) { *out++ = 0; count++; in_word = false; } } while (0)
+#define OPERATOR(k, t) do { WORD_END(); tokens[count].text = (t); tokens[count++].kind = (k); } while (0)
+// p is at the "(" of a $( in a word that is quoted or not
+#define SUBSTITUTION(quoted) do { \
+	const char *close = subst_close(p + 1, end); \
+	lex_substitution(subst, p - 1, close, end, quoted, &out, tokens, &count, &in_word); \
+	p = close < end ? close + 1 : end; \
+} while (0)
+
+	while (p < end) {
+		const char *run = lex_find(p, end, LEX_PLAIN);
+		if (run > p) {
+			WORD_START();
+			memcpy(out, p, run - p);
+			out += run - p;
+			p = run;
+			continue;
 		}
 
-		if (redirect_index != -1) {
-			// Check if filename is included in arg -> example: >out.txt
-			if (len>1) {
-				cmd->redirects[redirect_index] = malloc(len);
-				strcpy(cmd->redirects[redirect_index], arg + 1); // store the filename that follows the redirection symbol
-			} 
-			else { // for cases when there is space after redirection symbol -> example: > out.txt
-				pch = strtok(NULL, splitters); // parse again to get the filename
-				
-				if (pch == NULL) {
-					printf("ERROR! : No filename provided after redirection symbol\n");
-					cmd->name[0] = '\0'; // set command name empty
+		switch (*p++) {
+		case ' ':
+		case '\t':
+			WORD_END();
+			break;
+		case '\\':
+			WORD_START();
+			if (p < end)
+				*out++ = *p++;
+			break;
+		case '\'':
+			WORD_START();
+			run = lex_find(p, end, LEX_SQUOTE);
+			memcpy(out, p, run - p);
+			out += run - p;
+			p = run < end ? run + 1 : end;
+			break;
+		case '"':
+			WORD_START();
+			while (p < end) {
+				run = lex_find(p, end, LEX_DQUOTE);
+				memcpy(out, p, run - p);
+				out += run - p;
+				p = run;
+				if (p == end)
 					break;
+				if (*p == '$') {
+					if (++p < end && *p == '(')
+						SUBSTITUTION(true);
+					else
+						*out++ = '$';
+					continue;
 				}
+				if (*p++ == '"')
+					break;
+				if (p < end && (*p == '"' || *p == '\\' || *p == '$' || *p == '`'))
+					*out++ = *p++; // an escaped character
+				else
+					*out++ = '\\'; // any other backslash stays
+			}
+			break;
+		case '|':
+			OPERATOR(TOKEN_PIPE, "|");
+			break;
+		case '<':
+			if (p + 1 < end && p[0] == '<' && p[1] == '<') {
+				p += 2;
+				OPERATOR(TOKEN_HERESTRING, "<<<");
+			} else if (p < end && *p == '<') {
+				p++;
+				OPERATOR(TOKEN_HEREDOC, "<<");
+			} else {
+				OPERATOR(TOKEN_IN, "<");
+			}
+			break;
+		case '&':
+			OPERATOR(TOKEN_AMP, "&");
+			break;
+		case '$':
+			if (p < end && *p == '(') {
+				SUBSTITUTION(false);
+			} else {
+				WORD_START();
+				*out++ = '$';
+			}
+			break;
+		case '>':
+			if (p < end && *p == '>') {
+				p++;
+				OPERATOR(TOKEN_APPEND, ">>");
+			} else {
+				OPERATOR(TOKEN_OUT, ">");
+			}
+			break;
+		}
+	}
+	WORD_END();
+
+#undef WORD_START
+#undef WORD_END
+#undef OPERATOR
+#undef SUBSTITUTION
+
+	*tokens_out = tokens;
+	return count;
+}
+
+// Parse a command string of len bytes (it does not need to be NUL-terminated)
+// into a chain of command structs, allocated from arena. lex_line() turns the
+// line into tokens; the commands of a pipeline are built from the runs of
+// tokens between "|"s.
+static cmd_t *parse_line_subst(const char *line, int len, arena_t *arena, lex_subst_t *subst) {
+
+	// trim whitespace from both ends
+	while (len > 0 && is_blank(line[0])) {
+		line++;
+		len--;
+	}
+	while (len > 0 && is_blank(line[len - 1]))
+		len--;
+
+	cmd_t *cmd = arena_calloc(arena, sizeof(cmd_t));
+
+	// marked for auto-complete
+	if (len > 0 && line[len - 1] == '?') cmd->auto_complete = true;	// if command ends with ? mark it for auto-complete
 
-				cmd->redirects[redirect_index] = malloc(strlen(pch) + 1);
-				strcpy(cmd->redirects[redirect_index], pch); // store the filename that follows the redirection symbol
+	token_t *tokens;
+	int token_count = lex_line(line, len, arena, &tokens, subst);
+
+	// background execution: the line ends with an unquoted & ("sleep 5&" too)
+	if (token_count > 0 && tokens[token_count - 1].kind == TOKEN_AMP) {
+		cmd->background = true;
+		token_count--;
+	}
+
+	// build one command per run of tokens between "|"s
+	cmd_t *current = cmd;
+	int t = 0;
+	while (1) {
+		int stage_end = t; // the "|" ending this command, or token_count
+		while (stage_end < token_count && tokens[stage_end].kind != TOKEN_PIPE)
+			stage_end++;
+
+		// room for the name, every argument and the terminating NULL
+		current->args = arena_alloc(arena, sizeof(char *) * (stage_end - t + 2));
+		int arg_index = 0;
+
+		for (; t < stage_end; t++) {
+			int redirect_index;
+			switch (tokens[t].kind) {
+			case TOKEN_WORD:
+				current->args[arg_index++] = tokens[t].text;
+				continue;
+			case TOKEN_AMP: // & in the middle of a line, ignored like before
+				continue;
+			case TOKEN_IN:
+			case TOKEN_HEREDOC:
+			case TOKEN_HERESTRING:
+				redirect_index = 0; // 0 -> take input from file < (or from the text of << and <<<)
+				break;
+			case TOKEN_OUT:
+				redirect_index = 1; // 1 -> write output to file >
+				break;
+			default:
+				redirect_index = 2; // 2 -> append output to file >>
+				break;
+			}
 
+			// the next word is the file name, glued to the symbol or not
+			if (t + 1 >= stage_end || tokens[t + 1].kind != TOKEN_WORD) {
+				current->redirect_error = true; // process_command() prints the error
+				arg_index = 0; // no command to run
+				t = stage_end;
+				break;
+			}
+			int kind = tokens[t].kind;
+			char *word = tokens[++t].text;
+			if (redirect_index == 0) // the last of <, << and <<< wins
+				current->redirects[0] = current->here_doc = current->here_end = NULL;
+			if (kind == TOKEN_HEREDOC) {
+				current->here_end = word; // the document follows on the next lines
+			} else if (kind == TOKEN_HERESTRING) {
+				size_t word_len = strlen(word);
+				current->here_doc = arena_strndup(arena, word, word_len + 1);
+				current->here_doc[word_len] = '\n'; // like other shells, a here-string ends with a newline
+			} else {
+				current->redirects[redirect_index] = word;
 			}
-			
-			continue;
 		}
 
-		// normal arguments
-		if (len > 2 &&
-			((arg[0] == '"' && arg[len - 1] == '"') ||
-			 (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-		{
-			// gets rid of quotes from start and end
-			arg[--len] = 0; 
-			arg++;
-		}
+		// first argument is the name of the executable, "" if there is none;
+		// last argument should be NULL to delimit the end
+		if (arg_index == 0)
+			current->args[arg_index++] = "";
+		current->name = current->args[0];
+		current->args[arg_index] = NULL;
+		current->builtin = builtin_lookup(current->name);
+		current->arg_count = arg_index + 1; // name + arguments + NULL, like before
 
-		// store normal arguments
-		cmd->args = (char **)realloc(cmd->args, sizeof(char *) * (arg_index + 1)); // reallocate arguments array to make room for the new argument
+		if (t >= token_count)
+			break;
 
-		cmd->args[arg_index] = (char *)malloc(len + 1); // allocate memory for the new argument
-		strcpy(cmd->args[arg_index++], arg); // copy the new argument and increment the argument index
+		// pipe handling -> the words after the "|" form the next command of the chain
+		t++;
+		current->next = arena_calloc(arena, sizeof(cmd_t));
+		current = current->next;
 	}
 
-	// finalize the arguments array
-	cmd->arg_count = arg_index; // store number of arguments in the argument counter
+	return cmd;
+}
 
-    // first argument should be the name of the executable
-    // last argument should be NULL to delimit the end
 
-	// increase args size by 2
-	cmd->args = (char **)realloc(cmd->args, sizeof(char *) * (cmd->arg_count += 2));
+cmd_t *parse_line(const char *line, int len, arena_t *arena) {
+	lex_subst_t subst = { .mode = SUBST_KEEP };
+	cmd_t *cmd = parse_line_subst(line, len, arena, &subst);
+	if (subst.found)
+		cmd->source = arena_strndup(arena, line, len); // for expand_command()
+	return cmd;
+}
 
-	// shift everything forward by 1
-	for (int i = cmd->arg_count - 2; i > 0; --i)
-		cmd->args[i] = cmd->args[i - 1];	
+cmd_t *parse_command(const char *line, arena_t *arena) {
+	return parse_line(line, strlen(line), arena);
+}
 
-	// set args[0] as a copy of name
-	cmd->args[0] = strdup(cmd->name);
+// Here-documents. The lines after a command line with <<WORD, up to a line that
+// is exactly WORD, are the document; with several << in one pipeline the
+// documents follow one another. heredoc_read() takes them from data, the input
+// right after the command line, and sets *used to the bytes taken. It returns
+// false, and changes nothing, if data ends inside a document and more input may
+// follow (!last); at the real end of the input a document just ends there.
+static bool heredoc_read(cmd_t *cmd, const char *data, size_t len, bool last, size_t *used, arena_t *arena) {
+	size_t pos = 0;
+	for (int pass = 0; pass < 2; pass++) { // first check that every document is complete
+		pos = 0;
+		for (cmd_t *c = cmd; c != NULL; c = c->next) {
+			if (c->here_end == NULL)
+				continue;
+			size_t start = pos, end_len = strlen(c->here_end), body_end;
+			while (1) {
+				if (pos == len) {
+					if (!last)
+						return false;
+					body_end = len;
+					break;
+				}
+				const char *nl = memchr(data + pos, '\n', len - pos);
+				if (nl == NULL && !last)
+					return false;
+				size_t line_len = nl ? (size_t)(nl - (data + pos)) : len - pos;
+				if (line_len == end_len && memcmp(data + pos, c->here_end, end_len) == 0) {
+					body_end = pos;
+					pos += line_len + (nl != NULL);
+					break;
+				}
+				pos += line_len + (nl != NULL);
+			}
+			if (pass == 1) {
+				c->here_doc = arena_strndup(arena, data + start, body_end - start);
+				c->here_end = NULL;
+			}
+		}
+	}
+	*used = pos;
+	return true;
+}
 
-	// set args[arg_count-1] (last) to NULL
-	cmd->args[cmd->arg_count - 1] = NULL;
+static bool heredoc_pending(cmd_t *cmd) {
+	for (cmd_t *c = cmd; c != NULL; c = c->next)
+		if (c->here_end != NULL)
+			return true;
+	return false;
 }
 
+// Interactive here-documents: the lines are read with a "> " prompt, with the
+// terminal back in cooked mode so the line discipline does the editing.
+static void heredoc_prompt(cmd_t *cmd, arena_t *arena) {
+	if (!heredoc_pending(cmd))
+		return;
+	term_cooked();
+	char *data = NULL, *line = NULL;
+	size_t len = 0, line_cap = 0, used;
+	ssize_t n;
+	do {
+		printf("> ");
+		fflush(stdout);
+		n = getline(&line, &line_cap, stdin);
+		if (n > 0) {
+			data = realloc(data, len + n);
+			memcpy(data + len, line, n);
+			len += n;
+		}
+	} while (!heredoc_read(cmd, data, len, n <= 0, &used, arena));
+	if (n <= 0)
+		clearerr(stdin); // Ctrl-D ended the document, not the shell
+	free(line);
+	free(data);
+}
 
 
 // Prompt a command from the user
-void prompt( cmd_t *cmd) {
+cmd_t *prompt(arena_t *arena) {
 	size_t index = 0;
 	char c;
 	char buf[512];
@@ -255,29 +968,13 @@ void prompt( cmd_t *cmd) {
 
     int escape_code_state = 0; // ANSI escape code sequence 1 -> ESC , 2 -> ESC + [
 
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-
-	// ICANON : canonical mode: normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // disable canonical mode and disable automatic echo
-
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-
-    // if you exit from the process or return from this function
-    // without restoring the old settings, the whole terminal will
-    // be broken for everybody (including the bash outside)
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
+	term_raw(); // a no-op unless a foreground job just gave the terminal back
+	fflush(stdout); // output of the last command goes before the prompt
 	show_prompt();
 	buf[0] = 0;
 
 	while (1) {
+		term_flush(); // what the last key changed, in one write
 		c = getchar();
 
 		// tab
@@ -289,9 +986,7 @@ void prompt( cmd_t *cmd) {
 		// backspace
 		if (c == 127) {
 			if (index > 0) {
-				putchar(8); // go back 1
-	            putchar(' '); // write empty over
-            	putchar(8); // go back 1 again
+				term_puts("\b \b"); // go back 1, write empty over, go back 1 again
 				index--;
 			}
 			continue;
@@ -314,6 +1009,7 @@ void prompt( cmd_t *cmd) {
 
             // UP ARROW - currently it has a limited history function, limited to only 1 prior command
 		    if (c == 65) {
+				history_load(); // the history file is only read when it is first needed
 				if (history_count == 0){ // if histroy is empty
 					escape_code_state = 0; // reset state
 					continue;
@@ -321,23 +1017,15 @@ void prompt( cmd_t *cmd) {
 
 				if (history_idx > 0) history_idx--; // go back in history
 
-                buf[index] = 0; // nullify buffer
-				// visually clear everything from the terminal line:
-			    while (index > 0) { // delete everything
-				    putchar(8); // go back 1
-	                putchar(' '); // write empty over
-                	putchar(8); // go back 1 again
-				    index--;
-			    }
-
-				strcpy(buf, history[history_idx]); // copy previous command 
-				printf("%s", buf); // print last command           
+				size_t old_index = index;
+				history_copy(history_idx, buf, sizeof(buf)); // copy previous command 
 				index = strlen(buf); // update index to match length of buffer	
-		    
+				term_replace(old_index, buf); // redraw the line with the previous command
 		    }
 
             // DOWN ARROW - you might need this for the history feature
 		    if (c == 66) {
+				history_load();
 				if (history_count == 0){ // if histroy is empty
 					escape_code_state = 0; // reset state
 					continue;
@@ -347,44 +1035,28 @@ void prompt( cmd_t *cmd) {
 					history_idx++; // move forward  in history
 				}
 
-				buf[index] = 0; // nullify buffer
-				// visually clear everything from the terminal line:
-				while (index > 0) { // delete everything
-					putchar(8); // go back 1
-					putchar(' '); // write empty over
-					putchar(8); // go back 1 again
-					index--;
-				}
-
+				size_t old_index = index;
 				if (history_idx == history_count){
 					buf[0] = '\0'; // empty buffer if we scroll past newest
 				} else {
-					strcpy(buf, history[history_idx]); // copy previous command 
+					history_copy(history_idx, buf, sizeof(buf)); // copy previous command 
 				}
-
-				printf("%s", buf); // print last command           
 				index = strlen(buf); // update index to match length of buffer	
+				term_replace(old_index, buf); // redraw the line with the next command
 			}
 
             escape_code_state = 0; // reset state 
             continue;
         }
 
-		putchar(c); // echo the typed character to screen
+		term_put(&c, 1); // echo the typed character to screen
 
 		buf[index++] = c; // add the character to buffer
 		if (index >= sizeof(buf) - 1) break; // too long
 		if (autocomplete_buf[0]) { // if the autocomplete buffer is full, meaning that there is something to autocomplete, :
-			
-			while (index > 0) { // we first delete everything from the console.
-				putchar(8);
-				putchar(' ');
-				putchar(8);
-				index--;
-			}
-
-			strcpy(buf, autocomplete_buf); // then, we copy the autocompleted command name into the buffer and print it.
-			printf("%s", buf);
+			// we replace everything on the line with the autocompleted command name
+			term_replace(index, autocomplete_buf);
+			strcpy(buf, autocomplete_buf);
 			index = strlen(buf);
 
 			autocomplete_buf[0] = '\0';
@@ -396,6 +1068,7 @@ void prompt( cmd_t *cmd) {
 			break;
 
 	}
+	term_flush();
 
 	// trim newline from the end
 	if (index > 0 && buf[index - 1] == '\n') index--;	
@@ -405,258 +1078,2724 @@ void prompt( cmd_t *cmd) {
 	strcpy(oldbuf, buf);
 
 	if (strlen(buf) > 0) { // save non-empty command to history
-		if (history_count < MAX_HISTORY_SIZE){
-			strcpy(history[history_count], buf); // save current command
-			history_count++; // update history counter
-		}
-		else{
-			// if history is full, shift histroy array to left
-			for (int i=1; i<MAX_HISTORY_SIZE; i++){
-				strcpy(history[i-1], history[i]); // shift elements to the left, to the left
-			}
-			strcpy(history[MAX_HISTORY_SIZE - 1], strdup(buf)); // save current command to end of history array
-		}
-		
-		history_idx = history_count; // update history browsing index to point to most recend command
+		history_add(buf); // O(1), also appends it to the history file
 	}
 
-	parse_command(buf, cmd);
-
-	// MUST restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	// the terminal stays in raw mode, a foreground job switches it back (term_cooked())
+	return parse_command(buf, arena);
 }
 
 
-// Helper function to run a .sh file. It only takes the name
-// of the .sh file as an argument, ASSUMING that the programmer has
-// already checked that it was a shell file beforehand.
-
-void run_shell_script(char* file_name) {
-	char buffer[512];
-	FILE *script_file = fopen(file_name, "r");
-	
-	if (script_file == NULL) {
-		return;
-	}
-	
-	// Code to iterate over the file line by line.
-	while (fgets(buffer, sizeof(buffer), script_file)) {
-		buffer[strcspn(buffer, "\n")] = 0; // Removes the first occurrence of a newline.
-		// Here, I used the same logic as the main function. Each
-		// line is treated as a command, so a command struct is created.
-		// However, we don't want the terminal to ask for a user prompt,
-		// so I simply parsed the line and turned it into a command,
-		// processed the command, and freed it.
-		cmd_t *cmd = malloc(sizeof( cmd_t));
-		memset(cmd, 0, sizeof( cmd_t));
-		parse_command(buffer, cmd);
-		process_command(cmd);
-		free_command(cmd);
+// Script mode. A script is mmap'ed and parsed once into a list of commands
+// before anything runs, so there is no line length limit and no per-line I/O.
+// With SLASH_SCRIPT_CACHE=<dir> the parsed form is also saved in <dir>, keyed
+// by the script's path, size and mtime; later runs of the unchanged script load
+// that instead of parsing again. Cached strings are used straight out of the
+// (private, copy-on-write) mapping of the cache file.
+#define SCRIPT_CACHE_MAGIC 0x43534c53 // "SLSC"
+#define SCRIPT_CACHE_VERSION 4 // 2: quoting and escapes, 3: here-documents, 4: command substitution
+#define CACHE_NULL_STRING 0xffffffffu
+
+typedef struct script_t {
+	cmd_t **lines;
+	int line_count;
+	arena_t arena; // every cmd_t of the script
+	void *cache_map; // mapping the commands point into when loaded from the cache
+	size_t cache_len;
+} script_t;
+
+typedef struct script_cache_header_t {
+	uint32_t magic, version;
+	uint64_t size, ino, dev;
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t line_count;
+	uint32_t path_len; // followed by the script's path and its NUL
+} script_cache_header_t;
+
+// Growable output buffer (script cache files, lsfd output).
+typedef struct byte_buf_t {
+	char *data;
+	size_t len, cap;
+} byte_buf_t;
+
+static void buf_put(byte_buf_t *b, const void *data, size_t len) {
+	if (b->len + len > b->cap) {
+		b->cap = (b->len + len) * 2;
+		b->data = realloc(b->data, b->cap);
 	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
 }
 
-// Helper function to check if this is the last slash instance, and remove the kernel module if is
-void check_and_remove_module() {
-    FILE *fp;
-    char buffer[128];
-    int slash_count = 0;
-
-	// Get number of slash instances currently running
-    fp = popen("pgrep slash | wc -l", "r"); // Open a pipe to run the shell command
-    if (fp == NULL) {
-        perror("popen failed"); // Pipe creation failed
-        exit(1);
-    }
-
-    if (fgets(buffer, sizeof(buffer), fp) != NULL) { // Read output from command
-        slash_count = atoi(buffer); // Convert output string into an integer
-    }
-    pclose(fp); // Close the pipe
-
-    if (slash_count <= 1) { // If this is the last slash instance
-        printf("Last slash instance exiting. Removing kernel module...\n");
-        system("sudo rmmod mymodule"); // Remove the module
-    } 
+static void buf_put_u32(byte_buf_t *b, uint32_t v) {
+	buf_put(b, &v, sizeof(v));
 }
 
-int main(int argc, char*argv[]) {
-
-	// Check if kernel module is loaded, load it using sudo insmod if not
-	if (access("/proc/lsfd", F_OK) != 0) { // check if /proc/lsfd exist
-		printf("Kernel module not loaded. Loading now...\n");
-
-		int result = system("sudo insmod ./module/mymodule.ko"); // load the kernel module
-		if (result != 0){ // if loading fails
-			printf("ERROR ! : Kernel module loading has failed.");
-			exit(1); // can't continue without module
-		} 
-	} else{ // if already loaded, notify user
-		printf("Krnel module already loaded.");
+static void buf_put_str(byte_buf_t *b, const char *str) {
+	if (str == NULL) {
+		buf_put_u32(b, CACHE_NULL_STRING);
+		return;
 	}
+	uint32_t len = strlen(str);
+	buf_put_u32(b, len);
+	buf_put(b, str, len + 1);
+}
 
-    // TODO: see the top of the source code
-    // If the main function is provided with 2 arguments and the last
-    // argument contains ".sh", then we should execute the provided shell
-    // file. After execution, the terminal exits as instructed.
-    if (argc == 2 && strstr(argv[1], ".sh") != NULL) {
-	    run_shell_script(argv[1]);
-	    return 0;
-    }
-
-    printf("\n%s Shell implemented by %s (%s)",sysname,student1Name,student1Id);
-    if(groupSize>1) printf(" and %s (%s)",student2Name,student2Id);
-    printf("\n");
-
-	while (1) {
-		cmd_t *cmd = malloc(sizeof( cmd_t));		
-		memset(cmd, 0, sizeof( cmd_t));  // clear memory
+// Reading side: *pos walks through the mapping, false once the data runs out.
+static bool cache_get_u32(const char *map, size_t len, size_t *pos, uint32_t *v) {
+	if (*pos + sizeof(*v) > len)
+		return false;
+	memcpy(v, map + *pos, sizeof(*v));
+	*pos += sizeof(*v);
+	return true;
+}
 
-		prompt(cmd);
-        
-		process_command(cmd);        
+static bool cache_get_str(char *map, size_t len, size_t *pos, char **str) {
+	uint32_t str_len;
+	if (!cache_get_u32(map, len, pos, &str_len))
+		return false;
+	if (str_len == CACHE_NULL_STRING) {
+		*str = NULL;
+		return true;
+	}
+	if (*pos + str_len + 1 > len || map[*pos + str_len] != 0)
+		return false;
+	*str = map + *pos;
+	*pos += str_len + 1;
+	return true;
+}
 
-		free_command(cmd);
+static void script_add_line(script_t *script, cmd_t *cmd, int *capacity) {
+	if (script->line_count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		script->lines = realloc(script->lines, sizeof(cmd_t *) * *capacity);
 	}
+	script->lines[script->line_count++] = cmd;
+}
 
-	for (int i = 0; i < history_count; i++){ // clean history before program exists
-		free(history[i]);
+static void script_parse(script_t *script, const char *data, size_t len) {
+	int capacity = 0;
+	const char *end = data + len;
+	for (const char *line = data; line < end; ) {
+		const char *nl = memchr(line, '\n', end - line);
+		size_t line_len = nl ? (size_t)(nl - line) : (size_t)(end - line);
+		cmd_t *cmd = parse_line(line, line_len, &script->arena);
+		if (cmd->name[0] != 0 || cmd->redirect_error || cmd->next != NULL) // blank lines do nothing
+			script_add_line(script, cmd, &capacity);
+		line = nl ? nl + 1 : end;
+		size_t used = 0;
+		heredoc_read(cmd, line, end - line, true, &used, &script->arena); // lines of a <<WORD
+		line += used;
 	}
+}
 
-	printf("\n");
-	return 0;
+// <dir>/<hash of the script's real path>.cache, false if caching is off.
+static bool script_cache_file(const char *real_path, char *cache_path, size_t size) {
+	char *dir = getenv("SLASH_SCRIPT_CACHE");
+	if (dir == NULL || dir[0] == 0)
+		return false;
+	snprintf(cache_path, size, "%s/%08x.cache", dir, hash_string(real_path));
+	return true;
 }
 
-// Helper func to resolve the path of a command before execution 
-bool resolve_path(const char* cmd_name, char* path_result){
-	// I call the "getenv" function here to find the "PATH" environment variable. 
-	// This will basically return the possible directories for executable files, 
-	// which I will manually check for the absolute path.
-    char *path_env = getenv("PATH");
-	if (path_env == NULL) {
-		printf("ERROR! : The PATH environment variable was not set.");
+static bool script_cache_load(script_t *script, const char *cache_path, const char *real_path, struct stat *st) {
+	int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
 		return false;
-	}
-	
-	// Allocated space for a copy of the path environment, since I will be manipulating it.
-	char* path_copy = strdup(path_env);
-	
-	// The path variable contains a list of possible execution paths delimited by ":". So, I tokenize
-	// the string to access each path.
-	char* curr_directory = strtok(path_copy, ":");
-	bool path_found = false;
-	//char* path_to_execute;
-
-	while (curr_directory != NULL) {
-		char full_path[512];
-		// I append the name of the command to the curr_directory string, resulting in a possible 
-		// path of execution.
-		snprintf(full_path, sizeof(full_path), "%s/%s", curr_directory, cmd_name);
-		// The following function checks whether there is really a path which is executable
-		// on that specified address. "X_OK" indicates "executable".
-		if (access(full_path, X_OK) == 0) {
-			path_found = true;
-			//path_to_execute = full_path;
-			strcpy(path_result, full_path);
-			break; // I can terminate the loop now as the current "full_path" variable is correct.
+	struct stat cache_st;
+	char *map = MAP_FAILED;
+	if (fstat(fd, &cache_st) == 0 && (size_t)cache_st.st_size > sizeof(script_cache_header_t))
+		map = mmap(NULL, cache_st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	size_t len = cache_st.st_size;
+
+	script_cache_header_t header;
+	memcpy(&header, map, sizeof(header));
+	size_t pos = sizeof(header);
+	bool valid = header.magic == SCRIPT_CACHE_MAGIC && header.version == SCRIPT_CACHE_VERSION &&
+		header.size == (uint64_t)st->st_size && header.ino == (uint64_t)st->st_ino && header.dev == (uint64_t)st->st_dev &&
+		header.mtime_sec == st->st_mtim.tv_sec && header.mtime_nsec == st->st_mtim.tv_nsec &&
+		pos + header.path_len + 1 <= len && header.path_len == strlen(real_path) &&
+		memcmp(map + pos, real_path, header.path_len + 1) == 0;
+	pos += header.path_len + 1;
+
+	int capacity = 0;
+	for (uint32_t l = 0; valid && l < header.line_count; l++) {
+		uint32_t stages;
+		valid = cache_get_u32(map, len, &pos, &stages) && stages > 0;
+		cmd_t *first = NULL, **link = &first;
+		for (uint32_t i = 0; valid && i < stages; i++) {
+			uint32_t flags, argc;
+			cmd_t *cmd = arena_calloc(&script->arena, sizeof(cmd_t));
+			valid = cache_get_u32(map, len, &pos, &flags) && cache_get_u32(map, len, &pos, &argc) && argc < len;
+			if (!valid)
+				break;
+			cmd->background = flags & 1;
+			cmd->auto_complete = flags & 2;
+			cmd->redirect_error = flags & 4;
+			cmd->arg_count = argc + 1;
+			cmd->args = arena_alloc(&script->arena, sizeof(char *) * (argc + 1));
+			for (uint32_t a = 0; valid && a < argc; a++)
+				valid = cache_get_str(map, len, &pos, &cmd->args[a]) && cmd->args[a] != NULL;
+			cmd->args[argc] = NULL;
+			for (int r = 0; valid && r < 3; r++)
+				valid = cache_get_str(map, len, &pos, &cmd->redirects[r]);
+			valid = valid && cache_get_str(map, len, &pos, &cmd->here_doc) && cache_get_str(map, len, &pos, &cmd->source);
+			cmd->name = argc > 0 ? cmd->args[0] : "";
+			cmd->builtin = builtin_lookup(cmd->name);
+			*link = cmd;
+			link = &cmd->next;
 		}
+		if (valid)
+			script_add_line(script, first, &capacity);
+	}
 
-		curr_directory = strtok(NULL, ":"); // Keep tokenizing until we find a path.
-
+	if (!valid) { // stale or damaged, parse the script instead
+		munmap(map, len);
+		arena_reset(&script->arena);
+		script->line_count = 0;
+		return false;
 	}
-	
-	if (!path_found) {
-		printf("ERROR! %s: command not found\n", cmd_name);
+	script->cache_map = map;
+	script->cache_len = len;
+	return true;
+}
+
+static void script_cache_save(script_t *script, const char *cache_path, const char *real_path, struct stat *st) {
+	byte_buf_t b = { 0 };
+	script_cache_header_t header = {
+		.magic = SCRIPT_CACHE_MAGIC, .version = SCRIPT_CACHE_VERSION,
+		.size = st->st_size, .ino = st->st_ino, .dev = st->st_dev,
+		.mtime_sec = st->st_mtim.tv_sec, .mtime_nsec = st->st_mtim.tv_nsec,
+		.line_count = script->line_count, .path_len = strlen(real_path),
+	};
+	buf_put(&b, &header, sizeof(header));
+	buf_put(&b, real_path, header.path_len + 1);
+
+	for (int l = 0; l < script->line_count; l++) {
+		uint32_t stages = 0;
+		for (cmd_t *c = script->lines[l]; c != NULL; c = c->next)
+			stages++;
+		buf_put_u32(&b, stages);
+		for (cmd_t *c = script->lines[l]; c != NULL; c = c->next) {
+			buf_put_u32(&b, c->background | c->auto_complete << 1 | c->redirect_error << 2);
+			buf_put_u32(&b, c->arg_count - 1);
+			for (int a = 0; a < c->arg_count - 1; a++)
+				buf_put_str(&b, c->args[a]);
+			for (int r = 0; r < 3; r++)
+				buf_put_str(&b, c->redirects[r]);
+			buf_put_str(&b, c->here_doc);
+			buf_put_str(&b, c->source);
+		}
 	}
 
-	free(path_copy); // Free the memory allocated copy.
-	return path_found;
+	// write a temporary file and rename it, so a reader never sees half a cache
+	char tmp_path[600];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache_path, getpid());
+	char *dir = getenv("SLASH_SCRIPT_CACHE");
+	mkdir(dir, 0700); // fine if it already exists
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		bool ok = write(fd, b.data, b.len) == (ssize_t)b.len;
+		close(fd);
+		if (!ok || rename(tmp_path, cache_path) == -1)
+			unlink(tmp_path);
+	}
+	free(b.data);
 }
 
-void process_command( cmd_t *cmd) {
+// Loads a script's command list, from the cache if possible. false if the file
+// cannot be read.
+bool script_load(script_t *script, const char *file_name) {
+	memset(script, 0, sizeof(script_t));
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return false;
+	}
 
-    // built-ins
-	if (strcmp(cmd->name, "") == 0) return;
-	if (strcmp(cmd->name, "exit") == 0){
-		/*
-		before exiting, check if this is the last slash instance
-		if it is, remove the module from kernel
-		*/
-		check_and_remove_module(); // call helper func to handle last slash instance
-		exit(0); // exit like normal
-	}
-	if (strcmp(cmd->name, "cd") == 0) {
-		if (cmd->arg_count > 0) 
-			if (chdir(cmd->args[1]) == -1)
-                printf("- %s: %s  ---  %s\n", cmd->name, strerror(errno),cmd->args[1]);			            		
-        return;
+	char real_path[PATH_MAX], cache_path[512];
+	bool cache = realpath(file_name, real_path) != NULL && script_cache_file(real_path, cache_path, sizeof(cache_path));
+	if (cache && script_cache_load(script, cache_path, real_path, &st)) {
+		close(fd);
+		return true;
 	}
-	if (strcmp(cmd->name, "history") == 0) {
-		for (int i = 0; i<history_count; ++i){
-			printf("%d %s\n", i, history[i]);
+
+	if (st.st_size > 0) {
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return false;
 		}
-		return;
+		script_parse(script, data, st.st_size); // the commands are copied into the arena
+		munmap(data, st.st_size);
 	}
+	close(fd);
 
-	if (strcmp(cmd->name, "lsfd") == 0) {
-		// Check if the user provided exactly 2 arguments (PID and output file)
-		if (cmd->arg_count != 4) { // "lsfd", <pid>, <outputfile>, NULL
-            fprintf(stderr, "Usage: lsfd <PID> <output file>\n");
-            return;
-    	}
+	if (cache)
+		script_cache_save(script, cache_path, real_path, &st);
+	return true;
+}
 
-		// Build the path to the target process's fd directory in /proc
-		char proc_fd_path[512];
-		snprintf(proc_fd_path, sizeof(proc_fd_path), "/proc/%s/fd", cmd->args[1]);
-	
-		// Try to open the given process's fd directory
-		DIR *dir = opendir(proc_fd_path);
-		if (dir == NULL) {
-			perror("Cannot open /proc/<PID>/fd");
-			return;
+// Helper function to run a .sh file. It only takes the name
+// of the .sh file as an argument, ASSUMING that the programmer has
+// already checked that it was a shell file beforehand.
+void run_shell_script(char* file_name) {
+	script_t script;
+	if (!script_load(&script, file_name))
+		return;
+
+	// Each line was already turned into a command, so we don't want the
+	// terminal to ask for a user prompt, we simply process the commands in order.
+	running_script = true;
+	for (int i = 0; i < script.line_count; i++) {
+		process_command(script.lines[i]);
+		jobs_notify(); // frees finished background jobs
+	}
+}
+
+// Batch mode, for slash -c "<commands>" and for commands piped into the shell
+// (stdin is not a terminal). There is no prompt, no line editor, no termios and
+// no history: input is read in STREAM_CHUNK blocks and every complete line goes
+// straight to parse_line(). Because the shell reads ahead, a command that reads
+// stdin itself only gets what the shell has not buffered yet; give such
+// commands a < redirect.
+#define STREAM_CHUNK (64 * 1024)
+
+// Runs every complete line in data and returns how many bytes they took. With
+// last set, a final line without a newline is run too.
+static size_t run_lines(const char *data, size_t len, bool last, arena_t *arena) {
+	size_t pos = 0;
+	while (pos < len) {
+		const char *nl = memchr(data + pos, '\n', len - pos);
+		if (nl == NULL && !last)
+			break;
+		size_t line_len = nl ? (size_t)(nl - (data + pos)) : len - pos;
+		cmd_t *cmd = parse_line(data + pos, line_len, arena);
+		size_t next = pos + line_len + (nl != NULL), used = 0;
+		if (!heredoc_read(cmd, data + next, len - next, last, &used, arena))
+			break; // the here-document goes on in the next chunk, parse the line again then
+		process_command(cmd);
+		arena_reset(arena);
+		jobs_notify(); // frees finished background jobs
+		pos = next + used;
+	}
+	return pos;
+}
+
+// Runs the commands read from fd until end of input. Returns the exit status
+// of the last one.
+int run_stream(int fd) {
+	arena_t arena = { 0 };
+	size_t capacity = STREAM_CHUNK, len = 0;
+	char *buf = malloc(capacity);
+
+	running_script = true;
+	while (1) {
+		if (capacity - len < STREAM_CHUNK / 2) { // a long line is still incomplete
+			capacity *= 2;
+			buf = realloc(buf, capacity);
+		}
+		ssize_t n = read(fd, buf + len, capacity - len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		size_t used = run_lines(buf, len, false, &arena);
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+	run_lines(buf, len, true, &arena);
+	free(buf);
+	return last_status;
+}
+
+// Kernel module handling. The module is loaded by the first lsfd that needs it,
+// not at startup. Every open of /proc/lsfd holds a reference on the module and
+// a shell keeps its descriptor open until it exits, so the module's own
+// reference count is the number of shells using it. Both loading and removal
+// are plain syscalls; sudo is only spawned when we lack CAP_SYS_MODULE.
+static int lsfd_module_fd = -1;
+
+static bool load_module() {
+	int fd = open(MODULE_PATH, O_RDONLY | O_CLOEXEC);
+	if (fd != -1) {
+		int result = syscall(SYS_finit_module, fd, "", 0);
+		int err = errno;
+		close(fd);
+		if (result == 0 || err == EEXIST) // EEXIST: another shell was faster
+			return true;
+		if (err != EPERM)
+			return false;
+	}
+	return system("sudo insmod " MODULE_PATH) == 0; // load the kernel module
+}
+
+// This shell's /proc/lsfd descriptor, loading the module first if needed.
+// Returns -1 if the module cannot be loaded.
+static int lsfd_module_open() {
+	if (lsfd_module_fd != -1)
+		return lsfd_module_fd;
+	lsfd_module_fd = open(PROC_PATH, O_RDWR | O_CLOEXEC);
+	if (lsfd_module_fd == -1 && errno == ENOENT) { // check if /proc/lsfd exist
+		printf("Kernel module not loaded. Loading now...\n");
+		if (!load_module()) { // if loading fails
+			printf("ERROR ! : Kernel module loading has failed.\n");
+			return -1;
+		}
+		lsfd_module_fd = open(PROC_PATH, O_RDWR | O_CLOEXEC);
+	}
+	return lsfd_module_fd;
+}
+
+// Helper function to check if this is the last slash instance using the kernel
+// module, and remove the module if it is. Drops our reference first; removing
+// with O_NONBLOCK then fails (EWOULDBLOCK) as long as another shell holds one.
+void check_and_remove_module() {
+	if (lsfd_module_fd == -1) // this shell never used the module
+		return;
+	close(lsfd_module_fd);
+	lsfd_module_fd = -1;
+
+	if (syscall(SYS_delete_module, MODULE_NAME, O_NONBLOCK) == 0) {
+		printf("Last slash instance exiting. Kernel module removed.\n");
+		return;
+	}
+	if (errno != EPERM) // still in use, or already gone
+		return;
+
+	// Without CAP_SYS_MODULE: read the count ourselves, and only start sudo for
+	// the last instance. rmmod refuses a module that is in use, so a shell
+	// opening it in the meantime is safe.
+	char count[32];
+	int fd = open("/sys/module/" MODULE_NAME "/refcnt", O_RDONLY | O_CLOEXEC);
+	ssize_t len = fd != -1 ? read(fd, count, sizeof(count) - 1) : -1;
+	if (fd != -1)
+		close(fd);
+	if (len > 0) {
+		count[len] = 0;
+		if (atoi(count) == 0) { // If this is the last slash instance
+			printf("Last slash instance exiting. Removing kernel module...\n");
+			system("sudo rmmod " MODULE_NAME); // Remove the module
+		}
+	}
+}
+
+int main(int argc, char*argv[]) {
+
+	// The kernel module is loaded lazily by the first lsfd that needs it.
+
+    // TODO: see the top of the source code
+    // If the main function is provided with 2 arguments and the last
+    // argument contains ".sh", then we should execute the provided shell
+    // file. After execution, the terminal exits as instructed.
+    if (argc == 2 && strstr(argv[1], ".sh") != NULL) {
+		jobs_init();
+	    run_shell_script(argv[1]);
+		check_and_remove_module();
+	    return 0;
+    }
+
+	// slash -j N script.sh: run up to N script lines at the same time
+	if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+		int max_jobs = atoi(argv[2]);
+		if (max_jobs < 1) {
+			fprintf(stderr, "Usage: %s -j <jobs> <script>\n", argv[0]);
+			return 2;
+		}
+		jobs_init();
+		int status = run_script_parallel(argv[3], max_jobs);
+		check_and_remove_module();
+		return status;
+    }
+
+	// slash --serve <socket> [workers]: run command lines sent over a Unix socket
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "--serve") == 0) {
+		int worker_count = argc == 4 ? atoi(argv[3]) : SERVE_DEFAULT_WORKERS;
+		if (worker_count < 1) {
+			fprintf(stderr, "Usage: %s --serve <socket> [workers]\n", argv[0]);
+			return 2;
+		}
+		int status = serve(argv[2], worker_count);
+		check_and_remove_module();
+		return status;
+	}
+
+	// slash -c "<commands>": one command per line of the argument
+	if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+		jobs_init();
+		arena_t arena = { 0 };
+		running_script = true;
+		run_lines(argv[2], strlen(argv[2]), true, &arena);
+		check_and_remove_module();
+		return last_status;
+	}
+
+	jobs_init();
+	if (!isatty(STDIN_FILENO)) { // commands are piped in, nobody sees a prompt
+		int status = run_stream(STDIN_FILENO);
+		check_and_remove_module();
+		return status;
+	}
+	arena_t line_arena = { 0 };
+
+    printf("\n%s Shell implemented by %s (%s)",sysname,student1Name,student1Id);
+    if(groupSize>1) printf(" and %s (%s)",student2Name,student2Id);
+    printf("\n");
+
+	while (1) {
+		jobs_notify(); // tell the user about finished background jobs before the prompt
+
+		cmd_t *cmd = prompt(&line_arena); // the command lives in line_arena until the reset
+		heredoc_prompt(cmd, &line_arena);
+
+		process_command(cmd);        
+
+		arena_reset(&line_arena); // frees the whole command at once
+	}
+
+	printf("\n");
+	return 0;
+}
+
+// Executable lookup cache used by resolve_path(). Every command name we resolve is
+// remembered together with the PATH directory it was found in (or as a negative
+// entry if it was not found anywhere), so a hot command resolves without touching
+// the file system at all. The cache is thrown away when PATH changes, and the
+// directories are re-stat'ed at most once per PATH_REVALIDATE_NS to notice
+// binaries being installed or removed.
+#define PATH_CACHE_BUCKETS 256 // must be a power of two
+#define PATH_REVALIDATE_NS 1000000000L // 1 second
+
+typedef struct path_dir_t {
+	char *name;
+	struct timespec mtime; // zero if the directory could not be stat'ed
+	// executable index used by tab completion, see exe_index_sync()
+	bool indexed;
+	struct timespec indexed_mtime; // mtime the exes list was built for
+	char **exes;
+	int exe_count;
+} path_dir_t;
+
+typedef struct path_entry_t {
+	char *name;
+	char *path; // NULL for a negative ("not found") entry
+	int dir_idx; // index into path_dirs the command was found in
+	unsigned long hits;
+	struct path_entry_t *next;
+} path_entry_t;
+
+static path_entry_t *path_cache[PATH_CACHE_BUCKETS];
+static char *path_cache_env = NULL; // PATH value the cache was built for
+static path_dir_t *path_dirs = NULL;
+static int path_dir_count = 0;
+static bool path_has_relative_dir = false; // "." or "bin" in PATH depend on the cwd
+static struct timespec path_last_check;
+
+// Tab completion index: the sorted, de-duplicated union of every PATH
+// directory's executables. The strings are owned by path_dirs[i].exes.
+static char **exe_index = NULL;
+static int exe_index_count = 0;
+static bool exe_index_dirty = true;
+
+// Drops every cached entry with dir_idx >= min_dir, plus all negative entries
+// (a new binary in any directory can turn "not found" into "found").
+static void path_cache_invalidate(int min_dir) {
+	for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+		path_entry_t **link = &path_cache[b];
+		while (*link) {
+			path_entry_t *e = *link;
+			if (e->path == NULL || e->dir_idx >= min_dir) {
+				*link = e->next;
+				free(e->name);
+				free(e->path);
+				free(e);
+			} else {
+				link = &e->next;
+			}
+		}
+	}
+}
+
+void path_cache_clear() {
+	path_cache_invalidate(0);
+}
+
+static void stat_path_dir(path_dir_t *dir) {
+	struct stat st;
+	if (stat(dir->name, &st) == 0)
+		dir->mtime = st.st_mtim;
+	else
+		dir->mtime.tv_sec = dir->mtime.tv_nsec = 0;
+}
+
+// Splits a new PATH value into path_dirs and empties the cache.
+static void path_cache_reset(const char *path_env) {
+	path_cache_clear();
+	for (int i = 0; i < path_dir_count; i++) {
+		for (int j = 0; j < path_dirs[i].exe_count; j++)
+			free(path_dirs[i].exes[j]);
+		free(path_dirs[i].exes);
+		free(path_dirs[i].name);
+	}
+	free(path_dirs);
+	exe_index_dirty = true;
+	free(path_cache_env);
+
+	path_cache_env = strdup(path_env);
+	path_dirs = NULL;
+	path_dir_count = 0;
+	path_has_relative_dir = false;
+
+	char *path_copy = strdup(path_env);
+	for (char *dir = strtok(path_copy, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+		path_dirs = realloc(path_dirs, sizeof(path_dir_t) * (path_dir_count + 1));
+		memset(&path_dirs[path_dir_count], 0, sizeof(path_dir_t));
+		path_dirs[path_dir_count].name = strdup(dir);
+		stat_path_dir(&path_dirs[path_dir_count]);
+		if (dir[0] != '/')
+			path_has_relative_dir = true;
+		path_dir_count++;
+	}
+	free(path_copy);
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &path_last_check);
+}
+
+// Makes sure the cache matches the current PATH and the directories' contents.
+// getenv() and the coarse clock (vDSO) cost no syscalls, so in the common case
+// this does not enter the kernel at all.
+static void path_cache_sync(const char *path_env) {
+	if (path_cache_env == NULL || strcmp(path_cache_env, path_env) != 0) {
+		path_cache_reset(path_env);
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	long elapsed = (now.tv_sec - path_last_check.tv_sec) * 1000000000L + (now.tv_nsec - path_last_check.tv_nsec);
+	if (elapsed < PATH_REVALIDATE_NS)
+		return;
+	path_last_check = now;
+
+	int first_changed = -1;
+	for (int i = 0; i < path_dir_count; i++) {
+		struct timespec old = path_dirs[i].mtime;
+		stat_path_dir(&path_dirs[i]);
+		if (old.tv_sec != path_dirs[i].mtime.tv_sec || old.tv_nsec != path_dirs[i].mtime.tv_nsec) {
+			if (first_changed == -1)
+				first_changed = i;
+		}
+	}
+	if (first_changed != -1)
+		path_cache_invalidate(first_changed);
+}
+
+// Prints the cache for the hash builtin, in the same spirit as bash's "hash".
+void path_cache_print() {
+	bool empty = true;
+	for (int b = 0; b < PATH_CACHE_BUCKETS; b++) {
+		for (path_entry_t *e = path_cache[b]; e != NULL; e = e->next) {
+			if (empty)
+				printf("hits\tcommand\n");
+			empty = false;
+			if (e->path)
+				printf("%4lu\t%s\n", e->hits, e->path);
+			else
+				printf("%4lu\t%s (not found)\n", e->hits, e->name);
+		}
+	}
+	if (empty)
+		printf("hash: hash table empty\n");
+}
+
+// (Re)reads the executables of one PATH directory.
+static void index_path_dir(path_dir_t *dir) {
+	for (int j = 0; j < dir->exe_count; j++)
+		free(dir->exes[j]);
+	free(dir->exes);
+	dir->exes = NULL;
+	dir->exe_count = 0;
+	dir->indexed = true;
+	dir->indexed_mtime = dir->mtime;
+
+	DIR *directory = opendir(dir->name);
+	if (directory == NULL)
+		return;
+
+	int capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(directory)) != NULL) {
+		if (entry->d_name[0] == '.' && (entry->d_name[1] == 0 || (entry->d_name[1] == '.' && entry->d_name[2] == 0)))
+			continue;
+		// relative to the open directory, so no path building per entry
+		if (faccessat(dirfd(directory), entry->d_name, X_OK, 0) != 0)
+			continue;
+		if (dir->exe_count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			dir->exes = realloc(dir->exes, sizeof(char *) * capacity);
+		}
+		dir->exes[dir->exe_count++] = strdup(entry->d_name);
+	}
+	closedir(directory);
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Brings the completion index up to date. Only directories whose mtime changed
+// since they were indexed are read again; the merged array is re-sorted only
+// when something changed. Returns false if PATH is not set.
+static bool exe_index_sync() {
+	char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		return false;
+	path_cache_sync(path_env);
+
+	for (int i = 0; i < path_dir_count; i++) {
+		path_dir_t *dir = &path_dirs[i];
+		if (!dir->indexed || dir->indexed_mtime.tv_sec != dir->mtime.tv_sec || dir->indexed_mtime.tv_nsec != dir->mtime.tv_nsec) {
+			index_path_dir(dir);
+			exe_index_dirty = true;
+		}
+	}
+	if (!exe_index_dirty)
+		return true;
+
+	int total = 0;
+	for (int i = 0; i < path_dir_count; i++)
+		total += path_dirs[i].exe_count;
+	free(exe_index);
+	exe_index = malloc(sizeof(char *) * (total + 1));
+	exe_index_count = 0;
+	for (int i = 0; i < path_dir_count; i++)
+		for (int j = 0; j < path_dirs[i].exe_count; j++)
+			exe_index[exe_index_count++] = path_dirs[i].exes[j];
+
+	qsort(exe_index, exe_index_count, sizeof(char *), compare_names);
+
+	// drop names that appear in more than one directory
+	int unique = 0;
+	for (int i = 0; i < exe_index_count; i++)
+		if (unique == 0 || strcmp(exe_index[unique - 1], exe_index[i]) != 0)
+			exe_index[unique++] = exe_index[i];
+	exe_index_count = unique;
+	exe_index_dirty = false;
+	return true;
+}
+
+// Finds the executables starting with prefix. On return *first is the index of the
+// first match in exe_index and the number of matches is returned; the matches are
+// exe_index[*first] .. exe_index[*first + count - 1].
+static int exe_index_lookup(const char *prefix, int *first) {
+	size_t prefix_len = strlen(prefix);
+	int lo = 0, hi = exe_index_count;
+	while (lo < hi) { // lower bound of prefix
+		int mid = lo + (hi - lo) / 2;
+		if (strcmp(exe_index[mid], prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*first = lo;
+	int end = lo;
+	while (end < exe_index_count && strncmp(exe_index[end], prefix, prefix_len) == 0)
+		end++;
+	return end - lo;
+}
+
+// Called after a successful cd: relative PATH entries now point somewhere else.
+void path_cache_chdir() {
+	if (path_has_relative_dir)
+		path_cache_clear();
+}
+
+// Helper func to resolve the path of a command before execution 
+bool resolve_path(const char* cmd_name, char* path_result){
+	// I call the "getenv" function here to find the "PATH" environment variable. 
+	// This will basically return the possible directories for executable files, 
+	// which I will manually check for the absolute path.
+    char *path_env = getenv("PATH");
+	if (path_env == NULL) {
+		printf("ERROR! : The PATH environment variable was not set.");
+		return false;
+	}
+
+	path_cache_sync(path_env);
+
+	// Look the command up in the cache first, this is the path hot commands take.
+	unsigned int bucket = hash_string(cmd_name) & (PATH_CACHE_BUCKETS - 1);
+	for (path_entry_t *e = path_cache[bucket]; e != NULL; e = e->next) {
+		if (strcmp(e->name, cmd_name) == 0) {
+			e->hits++;
+			if (e->path == NULL) {
+				printf("ERROR! %s: command not found\n", cmd_name);
+				return false;
+			}
+			strcpy(path_result, e->path);
+			return true;
+		}
+	}
+
+	// Cache miss: the PATH variable contains a list of possible execution paths, which
+	// were already split into path_dirs, so I check each directory in order.
+	int found_idx = -1;
+	char full_path[512];
+
+	for (int i = 0; i < path_dir_count; i++) {
+		// I append the name of the command to the directory name, resulting in a possible 
+		// path of execution.
+		snprintf(full_path, sizeof(full_path), "%s/%s", path_dirs[i].name, cmd_name);
+		// The following function checks whether there is really a path which is executable
+		// on that specified address. "X_OK" indicates "executable".
+		if (access(full_path, X_OK) == 0) {
+			found_idx = i;
+			strcpy(path_result, full_path);
+			break; // I can terminate the loop now as the current "full_path" variable is correct.
+		}
+	}
+
+	// Remember the result, also when the command was not found.
+	path_entry_t *e = malloc(sizeof(path_entry_t));
+	e->name = strdup(cmd_name);
+	e->path = found_idx != -1 ? strdup(full_path) : NULL;
+	e->dir_idx = found_idx;
+	e->hits = 1;
+	e->next = path_cache[bucket];
+	path_cache[bucket] = e;
+
+	if (found_idx == -1) {
+		printf("ERROR! %s: command not found\n", cmd_name);
+		return false;
+	}
+	return true;
+}
+
+// Process launcher. External commands are started with posix_spawn(), which
+// glibc implements with clone(CLONE_VM | CLONE_VFORK): the child never copies
+// the shell's page tables, so the cost of starting a command does not grow with
+// the shell's address space the way fork() does. Redirect files are opened here
+// in the parent (so we can still tell the user which one failed) and handed to
+// the child through dup2 file actions, together with the pipe ends.
+// fork_command() is the old fork + dup2 + execv path; it is used when posix_spawn
+// is not usable and can be forced with SLASH_SPAWN=fork.
+
+// The stdin of a here-document or here-string: a memfd holding text, sealed
+// against any change and positioned at its start. Nothing touches the file
+// system and no process has to feed a pipe. -1 on failure.
+static int here_doc_fd(const char *text) {
+	int fd = memfd_create("slash-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1)
+		return -1;
+	size_t len = strlen(text), done = 0;
+	while (done < len) {
+		ssize_t n = write(fd, text + done, len - done);
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += n;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+		lseek(fd, 0, SEEK_SET) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Opens the file redirects of cmd. fds[0] is the stdin file (or the memfd of a
+// here-document), fds[1] the stdout file (from > or >>), -1 where there is no
+// redirect. The fds are close-on-exec.
+static bool open_redirects(cmd_t *cmd, int fds[2]) {
+	fds[0] = fds[1] = -1;
+
+	if (cmd->here_doc){ // for the << and <<< cases
+		fds[0] = here_doc_fd(cmd->here_doc);
+		if (fds[0] == -1){
+			printf("ERROR! : Problem about here-document (<<)\n");
+			return false;
+		}
+	}
+
+	if (cmd->redirects[0]){ // for the < case
+		fds[0] = open(cmd->redirects[0], O_RDONLY | O_CLOEXEC); // Open the file for reading 
+		if (fds[0] == -1){ // open() failed
+			printf("ERROR! : Problem about input redirection (<)\n");
+			return false;
+		}
+	}
+
+	if (cmd->redirects[1]){ // for the > case
+		fds[1] = open(cmd->redirects[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, // Open the file for writing, if it doesn't exist create a new file, if it exists delete it -> overwrite it
+			FILE_MODE); // Create file permissions: user read and write, group read, other read
+		if (fds[1] == -1){ // open() failed
+			printf("ERROR! : Problem about output redirection (>)\n");
+			if (fds[0] != -1) close(fds[0]);
+			return false;
+		}
+	}
+
+	if (cmd->redirects[2]){ // for the >> case
+		if (fds[1] != -1) close(fds[1]); // the later redirect wins, like before
+		fds[1] = open(cmd->redirects[2], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, // Open the file for writing, if it doesn't exist create a new file, if it exists append to existing file			
+			FILE_MODE); // Create file permissions: user read and write, group read, other read
+		if (fds[1] == -1){ // open() failed
+			printf("ERROR! : Problem about append redirection (>>)\n");
+			if (fds[0] != -1) close(fds[0]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool use_fork_launcher() {
+	static int forced = -1;
+	if (forced == -1) {
+		char *mode = getenv("SLASH_SPAWN");
+		forced = mode != NULL && strcmp(mode, "fork") == 0;
+	}
+	return forced;
+}
+
+// Job control state, set up by jobs_init(). With job control every job runs in
+// its own process group and the foreground job owns the terminal.
+static bool interactive = false; // reading commands from a terminal
+static bool job_control = false;
+static pid_t shell_pgid;
+
+// Signals the shell ignores for job control; children get them back at default.
+static const int job_control_signals[] = { SIGTSTP, SIGTTIN, SIGTTOU };
+
+// Forks a child that is set up like a launched command (process group, terminal,
+// signals, stdin/stdout) but keeps running shell code. Returns like fork().
+static pid_t fork_child(int in_fd, int out_fd, pid_t pgid, bool foreground) {
+	fflush(stdout); // do not let the child inherit (and print again) our buffered output
+	pid_t pid = fork();
+	if (pid != 0) {
+		if (pid > 0 && pgid >= 0)
+			setpgid(pid, pgid ? pgid : pid); // also done by the child, whoever runs first wins
+		return pid; // parent, or -1 if fork failed
+	}
+
+	// CHILD
+	if (pgid >= 0) {
+		setpgid(0, pgid);
+		if (foreground)
+			tcsetpgrp(STDIN_FILENO, getpgrp());
+	}
+	for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(int); i++)
+		signal(job_control_signals[i], SIG_DFL);
+	sigset_t empty;
+	sigemptyset(&empty);
+	sigprocmask(SIG_SETMASK, &empty, NULL);
+
+	if (in_fd != STDIN_FILENO) {
+		dup2(in_fd, STDIN_FILENO);
+		close(in_fd);
+	}
+	if (out_fd != STDOUT_FILENO) {
+		dup2(out_fd, STDOUT_FILENO);
+		close(out_fd);
+	}
+	return 0;
+}
+
+// Classic launcher: fork, wire up stdin/stdout, execv.
+static pid_t fork_command(const char *path, char **args, int in_fd, int out_fd, pid_t pgid, bool foreground) {
+	pid_t pid = fork_child(in_fd, out_fd, pgid, foreground);
+	if (pid != 0)
+		return pid;
+	execv(path, args);
+	_exit(127);
+}
+
+// Starts the executable at path with args, with stdin connected to in_fd and
+// stdout to out_fd (pass STDIN_FILENO/STDOUT_FILENO to leave them alone). All
+// other descriptors the child should not keep must be close-on-exec.
+// pgid < 0 keeps the child in the shell's process group, 0 makes it the leader
+// of a new group and > 0 puts it into that group. If foreground is set, the
+// child's group is also given the terminal before the program starts.
+// Returns the child's pid, or -1 with errno set.
+pid_t launch_command(const char *path, char **args, int in_fd, int out_fd, pid_t pgid, bool foreground) {
+	if (use_fork_launcher())
+		return fork_command(path, args, in_fd, out_fd, pgid, foreground);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (pgid >= 0 && foreground) {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+		// the child must own the terminal before it can read from it; this has to
+		// happen while stdin still is the terminal, so before the dup2 actions
+		posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#else
+		// no way to express tcsetpgrp() as a spawn action, fork instead
+		posix_spawn_file_actions_destroy(&actions);
+		return fork_command(path, args, in_fd, out_fd, pgid, foreground);
+#endif
+	}
+	if (in_fd != STDIN_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd != STDOUT_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+	// The caller blocks SIGCHLD while launching, and the job control signals may be
+	// ignored by the shell; the program must start with neither.
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	sigset_t mask, defaults;
+	sigemptyset(&mask);
+	sigemptyset(&defaults);
+	for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(int); i++)
+		sigaddset(&defaults, job_control_signals[i]);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	if (pgid >= 0) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		posix_spawnattr_setpgroup(&attr, pgid);
+	}
+	posix_spawnattr_setflags(&attr, flags);
+
+	pid_t pid;
+	int err = posix_spawn(&pid, path, &actions, &attr, args, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (err == ENOSYS || err == ENOMEM) // the spawn machinery itself failed, try the old way
+		return fork_command(path, args, in_fd, out_fd, pgid, foreground);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+
+// Zero-copy data paths. copy_fd() moves a whole stream between two descriptors
+// inside the kernel where it can: copy_file_range() between regular files,
+// splice() when either side is a pipe, sendfile() from a regular file to
+// anything else. Only when none of them applies does data pass through a
+// user-space buffer.
+#define COPY_CHUNK (1 << 20) // bytes per splice/sendfile/copy_file_range call
+
+// True for errors that mean "this method does not work for these descriptors".
+static bool copy_unsupported(int err) {
+	return err == EINVAL || err == EXDEV || err == EBADF || err == ENOSYS || err == EOPNOTSUPP || err == ESPIPE;
+}
+
+// Copies in_fd to out_fd until EOF. Returns 0, or -1 with errno set.
+int copy_fd(int in_fd, int out_fd) {
+	struct stat in_st, out_st;
+	if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+		return -1;
+	bool in_file = S_ISREG(in_st.st_mode), out_file = S_ISREG(out_st.st_mode);
+	bool in_pipe = S_ISFIFO(in_st.st_mode), out_pipe = S_ISFIFO(out_st.st_mode);
+	bool copied = false; // once data moved we cannot switch methods anymore
+	ssize_t n;
+
+	if (in_file && out_file) {
+		while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0)) > 0)
+			copied = true;
+		if (n == 0)
+			return 0;
+		if (copied || !copy_unsupported(errno)) // e.g. O_APPEND output is not supported
+			return -1;
+	}
+
+	if (in_pipe || out_pipe) {
+		while ((n = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+			copied = true;
+		if (n == 0)
+			return 0;
+		if (copied || !copy_unsupported(errno))
+			return -1;
+	}
+
+	if (in_file) {
+		while ((n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK)) > 0)
+			copied = true;
+		if (n == 0)
+			return 0;
+		if (copied || !copy_unsupported(errno))
+			return -1;
+	}
+
+	// plain read/write for everything else (terminals, sockets, ...)
+	static char buf[128 * 1024];
+	while ((n = read(in_fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t done = 0; done < n;) {
+			ssize_t w = write(out_fd, buf + done, n - done);
+			if (w == -1)
+				return -1;
+			done += w;
+		}
+	}
+	return n == 0 ? 0 : -1;
+}
+
+// "cat" with only file name arguments (no options, no "-"), the form we can run
+// without executing /bin/cat.
+static bool is_plain_cat(cmd_t *cmd) {
+	if (strcmp(cmd->name, "cat") != 0)
+		return false;
+	for (int i = 1; cmd->args[i] != NULL; i++)
+		if (cmd->args[i][0] == '-')
+			return false;
+	return true;
+}
+
+// The in-process cat: copies each file to out_fd. Returns the exit status.
+static int cat_files(char **files, int out_fd) {
+	int status = 0;
+	for (int i = 0; files[i] != NULL; i++) {
+		int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+			status = 1;
+			continue;
+		}
+		if (copy_fd(fd, out_fd) == -1) {
+			fprintf(stderr, "cat: %s: %s\n", files[i], strerror(errno));
+			status = 1;
+		}
+		close(fd);
+	}
+	return status;
+}
+
+// Job table. Every external command or pipeline that is started becomes a job;
+// foreground jobs are removed once they finish, background jobs once the user
+// was told they are done. Children are reaped only by the SIGCHLD handler, with
+// wait4(-1, WNOHANG), which stores each stage's status, resource usage and end
+// time in the table. The rest of the shell reads or changes the table only while
+// SIGCHLD is blocked.
+#define MAX_JOBS 64
+
+enum { STAGE_RUNNING, STAGE_STOPPED, STAGE_DONE };
+
+// A pipe between two stages that the shell watches, see pipes_sample().
+typedef struct pipe_stat_t {
+	int fd; // the shell's copy of the read end, -1 once the reader finished
+	int writer, reader; // stage indices, -1 if that stage could not be started
+	int capacity;
+	int full_streak; // samples in a row the pipe was found full
+	double full_time, empty_time; // seconds the writer / the reader had to wait
+	long long written; // writer's wchar, at the last sample until written_final
+	bool written_final; // read when the writer was reaped
+} pipe_stat_t;
+
+typedef struct job_t {
+	int id; // job number shown as [id], 0 for an unused slot
+	pid_t pgid; // -1 if the job runs in the shell's process group
+	char *command; // command line for the jobs listing
+	bool background;
+	int stage_count;
+	pid_t *pids;
+	int *statuses; // wait status of each stage
+	volatile sig_atomic_t *states; // STAGE_* of each stage
+	char **names; // program of each stage, for the time report
+	struct rusage *usages; // resource usage of each finished stage
+	struct timespec started; // when the job was created
+	struct timespec *ended; // when each stage was reaped
+	bool timed; // started by the time builtin, report its usage when it finishes
+	pipe_stat_t *pipes; // watched pipes of a foreground pipeline
+	int pipe_count;
+	bool pipe_auto, pipe_stats; // SLASH_PIPESIZE=auto, SLASH_PIPESTATS
+	struct timespec pipes_sampled;
+} job_t;
+
+static job_t jobs[MAX_JOBS];
+int last_status = 0; // exit status of the last foreground job, like $?
+static bool time_requested = false; // jobs created now are run by the time builtin
+static bool time_reported = false; // a timed job printed its report
+
+static void block_sigchld(sigset_t *old) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static void restore_sigmask(sigset_t *old) {
+	sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+// The bytes pid has written so far, from /proc/<pid>/io, -1 if unknown. Only
+// async-signal-safe calls, the SIGCHLD handler uses it.
+static long long process_wchar(pid_t pid) {
+	char path[32] = "/proc/", digits[16], text[512];
+	int n = 0, len = 6;
+	do
+		digits[n++] = '0' + pid % 10;
+	while ((pid /= 10) > 0);
+	while (n > 0)
+		path[len++] = digits[--n];
+	memcpy(path + len, "/io", 4);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	ssize_t size = read(fd, text, sizeof(text) - 1);
+	close(fd);
+	for (ssize_t i = 0; i + 7 <= size; i++) {
+		if ((i == 0 || text[i - 1] == '\n') && memcmp(text + i, "wchar: ", 7) == 0) {
+			long long wchar = 0;
+			for (i += 7; i < size && text[i] >= '0' && text[i] <= '9'; i++)
+				wchar = wchar * 10 + (text[i] - '0');
+			return wchar;
+		}
+	}
+	return -1;
+}
+
+// A stage that writes into a pipe with stats on is about to be reaped: its
+// /proc/<pid>/io goes away with it, so this is the last chance to read its
+// final wchar.
+static void pipes_writer_done(pid_t pid) {
+	for (int j = 0; j < MAX_JOBS; j++) {
+		if (jobs[j].id == 0 || !jobs[j].pipe_stats)
+			continue;
+		for (int p = 0; p < jobs[j].pipe_count; p++) {
+			pipe_stat_t *pipe = &jobs[j].pipes[p];
+			if (pipe->writer == -1 || jobs[j].pids[pipe->writer] != pid)
+				continue;
+			long long written = process_wchar(pid);
+			if (written != -1) {
+				pipe->written = written;
+				pipe->written_final = true;
+			}
+		}
+	}
+}
+
+static void sigchld_handler(int sig) {
+	(void)sig;
+	int saved_errno = errno;
+	int status;
+	struct rusage usage;
+	pid_t pid;
+	siginfo_t info;
+
+	// waitid(WNOWAIT) finds the next child without reaping it, so a finished pipe
+	// writer can still be looked at in /proc before wait4() removes it
+	while (1) {
+		info.si_pid = 0;
+		if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0)
+			break;
+		if (info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED)
+			pipes_writer_done(info.si_pid);
+		if ((pid = wait4(info.si_pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) <= 0)
+			break;
+		for (int j = 0; j < MAX_JOBS; j++) {
+			if (jobs[j].id == 0)
+				continue;
+			for (int i = 0; i < jobs[j].stage_count; i++) {
+				if (jobs[j].pids[i] != pid)
+					continue;
+				if (WIFSTOPPED(status)) {
+					jobs[j].states[i] = STAGE_STOPPED;
+				} else if (WIFCONTINUED(status)) {
+					jobs[j].states[i] = STAGE_RUNNING;
+				} else {
+					jobs[j].statuses[i] = status;
+					jobs[j].usages[i] = usage;
+					clock_gettime(CLOCK_MONOTONIC, &jobs[j].ended[i]); // async-signal-safe
+					jobs[j].states[i] = STAGE_DONE;
+					// without readers left the writer has to get EPIPE, not wait for us
+					for (int p = 0; p < jobs[j].pipe_count; p++) {
+						if (jobs[j].pipes[p].reader == i && jobs[j].pipes[p].fd != -1) {
+							close(jobs[j].pipes[p].fd);
+							jobs[j].pipes[p].fd = -1;
+						}
+					}
+				}
+			}
+		}
+	}
+	errno = saved_errno;
+}
+
+// Sets up SIGCHLD reaping and, for an interactive shell that owns its terminal,
+// job control.
+void jobs_init() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART; // do not break getchar() at the prompt
+	sigaction(SIGCHLD, &sa, NULL);
+
+	sigset_t set; // a blocked SIGCHLD is inherited through exec, and would hang every job
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+	interactive = isatty(STDIN_FILENO);
+	shell_pgid = getpgrp();
+	job_control = interactive && tcgetpgrp(STDIN_FILENO) == shell_pgid;
+	if (job_control) {
+		// stay alive while handing the terminal back and forth
+		for (size_t i = 0; i < sizeof(job_control_signals) / sizeof(int); i++)
+			signal(job_control_signals[i], SIG_IGN);
+	}
+}
+
+// Joins the stages of a pipeline, with their file redirects, back into a
+// command line.
+static char *command_text(cmd_t *cmd) {
+	static const char *redirect_ops[3] = { " < ", " > ", " >> " };
+	size_t len = 1;
+	for (cmd_t *c = cmd; c != NULL; c = c->next) {
+		for (int i = 0; c->args[i] != NULL; i++)
+			len += strlen(c->args[i]) + 3;
+		for (int r = 0; r < 3; r++)
+			if (c->redirects[r] != NULL)
+				len += strlen(c->redirects[r]) + 4;
+	}
+
+	char *text = malloc(len + 2);
+	text[0] = 0;
+	for (cmd_t *c = cmd; c != NULL; c = c->next) {
+		if (c != cmd)
+			strcat(text, " | ");
+		for (int i = 0; c->args[i] != NULL; i++) {
+			if (i > 0)
+				strcat(text, " ");
+			strcat(text, c->args[i]);
+		}
+		for (int r = 0; r < 3; r++) {
+			if (c->redirects[r] != NULL) {
+				strcat(text, redirect_ops[r]);
+				strcat(text, c->redirects[r]);
+			}
+		}
+	}
+	if (cmd->background)
+		strcat(text, " &");
+	return text;
+}
+
+// Creates a job for cmd with room for every stage. Call with SIGCHLD blocked.
+static job_t *job_create(cmd_t *cmd) {
+	int slot = -1, id = 1;
+	for (int j = 0; j < MAX_JOBS; j++) {
+		if (jobs[j].id == 0) {
+			if (slot == -1)
+				slot = j;
+		} else if (jobs[j].id >= id) {
+			id = jobs[j].id + 1;
+		}
+	}
+	if (slot == -1) {
+		printf("ERROR! : too many jobs\n");
+		return NULL;
+	}
+
+	int stages = 0;
+	for (cmd_t *c = cmd; c != NULL; c = c->next)
+		stages++;
+
+	if (!cmd->background)
+		term_cooked(); // the job may read the terminal, give it back the usual settings
+
+	job_t *job = &jobs[slot];
+	job->id = id;
+	job->pgid = job_control ? 0 : -1; // 0: the first stage becomes the leader
+	job->command = command_text(cmd);
+	job->background = cmd->background;
+	job->stage_count = 0;
+	job->pids = malloc(sizeof(pid_t) * stages);
+	job->statuses = calloc(stages, sizeof(int));
+	job->states = malloc(sizeof(sig_atomic_t) * stages);
+	job->names = malloc(sizeof(char *) * stages);
+	job->usages = calloc(stages, sizeof(struct rusage));
+	job->ended = calloc(stages, sizeof(struct timespec));
+	job->timed = time_requested;
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	return job;
+}
+
+// Records a started stage running program name. Call with SIGCHLD blocked.
+static void job_add_stage(job_t *job, pid_t pid, const char *name) {
+	if (job->pgid == 0)
+		job->pgid = pid;
+	job->states[job->stage_count] = STAGE_RUNNING;
+	job->names[job->stage_count] = strdup(name);
+	job->pids[job->stage_count++] = pid;
+}
+
+static void job_free(job_t *job) {
+	for (int i = 0; i < job->stage_count; i++)
+		free(job->names[i]);
+	free(job->command);
+	free(job->pids);
+	free(job->statuses);
+	free((void *)job->states);
+	free(job->names);
+	free(job->usages);
+	free(job->ended);
+	for (int p = 0; p < job->pipe_count; p++)
+		if (job->pipes[p].fd != -1)
+			close(job->pipes[p].fd);
+	free(job->pipes);
+	memset(job, 0, sizeof(job_t));
+}
+
+static int job_count_stages(job_t *job, int state) {
+	int count = 0;
+	for (int i = 0; i < job->stage_count; i++)
+		if (job->states[i] == state)
+			count++;
+	return count;
+}
+
+// Exit status for a wait status: the exit code, or 128 + the signal.
+static int exit_status(int status) {
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+// Exit status of a job, taken from its last stage like other shells do.
+static int job_exit_status(job_t *job) {
+	if (job->stage_count == 0)
+		return 127;
+	return exit_status(job->statuses[job->stage_count - 1]);
+}
+
+// Resource usage of finished commands. The time builtin prints it, and with
+// SLASH_ACCOUNTING=<file> one JSON line per command is appended to the file:
+// {"end":<unix time>,"command":...,"status":...,"real":...,"user":...,"sys":...,
+// "maxrss_kb":...,"nvcsw":...,"nivcsw":...,"stages":[{"name":...,"pid":...,...}]}
+// with times in seconds. External commands get their numbers from wait4(), one
+// set per pipeline stage; builtins run in the shell get a getrusage() difference
+// and no stages. RUSAGE_SELF only knows the shell's peak RSS over its whole life,
+// so builtins have no maxrss ("-" when printed, null in the record).
+static int accounting_fd = -1;
+
+static double timespec_seconds(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static double timeval_seconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Adds b's counters to a. maxrss is a peak, so a keeps the larger one.
+static void rusage_add(struct rusage *a, const struct rusage *b) {
+	timeradd(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+	timeradd(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+	if (b->ru_maxrss > a->ru_maxrss)
+		a->ru_maxrss = b->ru_maxrss;
+	a->ru_nvcsw += b->ru_nvcsw;
+	a->ru_nivcsw += b->ru_nivcsw;
+}
+
+// Subtracts an earlier getrusage() from a later one. A difference of two
+// lifetime peaks means nothing, so maxrss becomes -1 (unknown).
+static void rusage_sub(struct rusage *a, const struct rusage *b) {
+	a->ru_maxrss = -1;
+	timersub(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+	timersub(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+	a->ru_nvcsw -= b->ru_nvcsw;
+	a->ru_nivcsw -= b->ru_nivcsw;
+}
+
+static void usage_print(const char *label, double real, const struct rusage *ru) {
+	char maxrss[32] = "-";
+	if (ru->ru_maxrss >= 0)
+		snprintf(maxrss, sizeof(maxrss), "%ldK", ru->ru_maxrss);
+	fprintf(stderr, "%-16s real %.3fs  user %.3fs  sys %.3fs  maxrss %s  csw %ld vol / %ld invol\n",
+		label, real, timeval_seconds(ru->ru_utime), timeval_seconds(ru->ru_stime),
+		maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+static bool accounting_enabled() {
+	if (accounting_fd == -1) {
+		const char *path = getenv("SLASH_ACCOUNTING");
+		if (path == NULL || path[0] == 0)
+			return false;
+		accounting_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	}
+	return accounting_fd != -1;
+}
+
+static void buf_put_json_string(byte_buf_t *b, const char *str) {
+	buf_put(b, "\"", 1);
+	for (; *str != 0; str++) {
+		char escaped[8];
+		if (*str == '"' || *str == '\\')
+			snprintf(escaped, sizeof(escaped), "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			snprintf(escaped, sizeof(escaped), "\\u%04x", *str);
+		else {
+			buf_put(b, str, 1);
+			continue;
+		}
+		buf_put(b, escaped, strlen(escaped));
+	}
+	buf_put(b, "\"", 1);
+}
+
+static void buf_put_usage(byte_buf_t *b, int status, double real, const struct rusage *ru) {
+	char text[256], maxrss[32] = "null";
+	if (ru->ru_maxrss >= 0)
+		snprintf(maxrss, sizeof(maxrss), "%ld", ru->ru_maxrss);
+	int len = snprintf(text, sizeof(text),
+		",\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%s,\"nvcsw\":%ld,\"nivcsw\":%ld",
+		status, real, timeval_seconds(ru->ru_utime), timeval_seconds(ru->ru_stime),
+		maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+	buf_put(b, text, len);
+}
+
+// Appends the accounting record of a command; job is NULL for a builtin.
+static void account_command(const char *command, int status, double real, const struct rusage *total, job_t *job) {
+	byte_buf_t b = { 0 };
+	char text[64];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	int len = snprintf(text, sizeof(text), "{\"end\":%lld.%06ld,\"command\":", (long long)now.tv_sec, now.tv_nsec / 1000);
+	buf_put(&b, text, len);
+	buf_put_json_string(&b, command);
+	buf_put_usage(&b, status, real, total);
+	if (job != NULL) {
+		buf_put(&b, ",\"stages\":[", 11);
+		for (int i = 0; i < job->stage_count; i++) {
+			buf_put(&b, i == 0 ? "{\"name\":" : ",{\"name\":", i == 0 ? 8 : 9);
+			buf_put_json_string(&b, job->names[i]);
+			len = snprintf(text, sizeof(text), ",\"pid\":%d", job->pids[i]);
+			buf_put(&b, text, len);
+			buf_put_usage(&b, exit_status(job->statuses[i]), timespec_seconds(&job->started, &job->ended[i]), &job->usages[i]);
+			buf_put(&b, "}", 1);
+		}
+		buf_put(&b, "]", 1);
+	}
+	buf_put(&b, "}\n", 2);
+	write(accounting_fd, b.data, b.len); // one write, so records of concurrent shells do not interleave
+	free(b.data);
+}
+
+// Reports the usage of a job whose stages all finished, before it is freed:
+// to the user if the time builtin started it, and to the accounting file. A
+// pipeline's real time runs until its last stage was reaped.
+static void job_report_usage(job_t *job) {
+	bool account = accounting_enabled();
+	if (!job->timed && !account)
+		return;
+
+	struct rusage total;
+	memset(&total, 0, sizeof(total));
+	double real = 0;
+	for (int i = 0; i < job->stage_count; i++) {
+		double stage_real = timespec_seconds(&job->started, &job->ended[i]);
+		if (job->timed && job->stage_count > 1) {
+			char label[64];
+			snprintf(label, sizeof(label), "[%d] %s", i + 1, job->names[i]);
+			usage_print(label, stage_real, &job->usages[i]);
+		}
+		rusage_add(&total, &job->usages[i]);
+		if (stage_real > real)
+			real = stage_real;
+	}
+	if (job->timed) {
+		usage_print(job->stage_count > 1 ? "total" : job->names[0], real, &total);
+		time_reported = true;
+	}
+	if (account)
+		account_command(job->command, job_exit_status(job), real, &total, job);
+}
+
+// Pipe sizing. SLASH_PIPESIZE=<bytes>[k|m] sets the capacity of every pipe of
+// a pipeline with F_SETPIPE_SZ (up to fs.pipe-max-size). With SLASH_PIPESIZE=auto
+// pipes start at the kernel's default and a pipe's capacity is doubled whenever
+// it was found full PIPE_GROW_SAMPLES samples in a row, that is for a writer
+// that keeps outrunning its reader. SLASH_PIPESTATS=1 prints, once a pipeline
+// finished, each pipe's capacity, how much its writer wrote (wchar in
+// /proc/<pid>/io) and how long the pipe was full (the writer was blocked) or
+// empty (the reader was waiting). Both watch the pipes of a foreground pipeline
+// while the shell waits for it: every PIPE_SAMPLE_MS FIONREAD tells how full
+// each pipe is, through a copy of its read end that the shell keeps until the
+// reader exits.
+#define PIPE_SAMPLE_MS 5
+#define PIPE_GROW_SAMPLES 2
+
+// Parses SLASH_PIPESIZE: the capacity to set, 0 to leave it, or -1 for auto.
+static long pipe_size_setting() {
+	const char *setting = getenv("SLASH_PIPESIZE");
+	if (setting == NULL || setting[0] == 0)
+		return 0;
+	if (strcmp(setting, "auto") == 0)
+		return -1;
+	char *end;
+	long size = strtol(setting, &end, 10);
+	if (*end == 'k' || *end == 'K')
+		size <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		size <<= 20;
+	return size > 0 ? size : 0;
+}
+
+static int pipe_max_size() {
+	static int max_size = 0;
+	if (max_size == 0) {
+		FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+		if (file == NULL || fscanf(file, "%d", &max_size) != 1)
+			max_size = 1 << 20;
+		if (file != NULL)
+			fclose(file);
+	}
+	return max_size;
+}
+
+// Sets the capacity of the pipe fd (any end) and returns the capacity it got.
+static int pipe_set_size(int fd, long size) {
+	if (size > pipe_max_size())
+		size = pipe_max_size(); // more needs CAP_SYS_RESOURCE
+	fcntl(fd, F_SETPIPE_SZ, (int)size);
+	return fcntl(fd, F_GETPIPE_SZ);
+}
+
+// Starts watching the pipe whose read end is read_fd, written by stage writer.
+// Returns NULL if the pipe cannot be watched.
+static pipe_stat_t *pipe_watch(job_t *job, int read_fd, int writer) {
+	pipe_stat_t *p = &job->pipes[job->pipe_count];
+	memset(p, 0, sizeof(pipe_stat_t));
+	p->fd = fcntl(read_fd, F_DUPFD_CLOEXEC, 10);
+	p->writer = writer;
+	p->reader = -1;
+	p->capacity = fcntl(read_fd, F_GETPIPE_SZ);
+	p->written = -1;
+	if (p->fd == -1)
+		return NULL;
+	job->pipe_count++;
+	return p;
+}
+
+// The stage that reads pipe p could not be started (reader -1): stop watching
+// it, the shell's copy is the only read end left.
+static void pipe_unwatch(pipe_stat_t *p) {
+	if (p->reader == -1 && p->fd != -1) {
+		close(p->fd);
+		p->fd = -1;
+	}
+}
+
+// Takes one sample of every watched pipe. Call with SIGCHLD blocked.
+static void pipes_sample(job_t *job) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = timespec_seconds(&job->pipes_sampled, &now);
+	job->pipes_sampled = now;
+
+	for (int i = 0; i < job->pipe_count; i++) {
+		pipe_stat_t *p = &job->pipes[i];
+		if (p->fd == -1 || p->writer == -1 || job->states[p->writer] == STAGE_DONE)
+			continue;
+		int queued;
+		if (ioctl(p->fd, FIONREAD, &queued) == -1)
+			continue;
+		bool full = queued >= p->capacity - p->capacity / 8; // not every page is filled to the end
+		if (full)
+			p->full_time += elapsed;
+		else if (queued == 0)
+			p->empty_time += elapsed;
+		p->full_streak = full ? p->full_streak + 1 : 0;
+
+		if (job->pipe_auto && p->full_streak >= PIPE_GROW_SAMPLES && p->capacity < pipe_max_size()) {
+			p->capacity = pipe_set_size(p->fd, (long)p->capacity * 2);
+			p->full_streak = 0;
+		}
+		if (job->pipe_stats) {
+			long long written = process_wchar(job->pids[p->writer]);
+			if (written != -1)
+				p->written = written;
+		}
+	}
+}
+
+static void pipes_report(job_t *job) {
+	for (int i = 0; i < job->pipe_count; i++) {
+		pipe_stat_t *p = &job->pipes[i];
+		if (p->writer == -1 || p->reader == -1)
+			continue;
+		char written[32] = "?";
+		if (p->written != -1) // a sampled value only says "at least"
+			snprintf(written, sizeof(written), "%s%.1fM", p->written_final ? "" : ">=", p->written / 1048576.0);
+		fprintf(stderr, "pipe %d %s -> %s: %dK buffer, %s written, full %.3fs, empty %.3fs\n",
+			i + 1, job->names[p->writer], job->names[p->reader], p->capacity >> 10,
+			written, p->full_time, p->empty_time);
+	}
+}
+
+static job_t *find_job(int id) {
+	for (int j = 0; j < MAX_JOBS; j++)
+		if (jobs[j].id != 0 && jobs[j].id == id)
+			return &jobs[j];
+	return NULL;
+}
+
+// The job "fg"/"bg"/"wait" act on without an argument: the newest one.
+static job_t *current_job() {
+	job_t *newest = NULL;
+	for (int j = 0; j < MAX_JOBS; j++)
+		if (jobs[j].id != 0 && (newest == NULL || jobs[j].id > newest->id))
+			newest = &jobs[j];
+	return newest;
+}
+
+// Parses "%n" or "n" for the job builtins, or picks the current job.
+static job_t *job_from_arg(const char *arg) {
+	if (arg == NULL)
+		return current_job();
+	if (arg[0] == '%')
+		arg++;
+	return find_job(atoi(arg));
+}
+
+static void job_signal(job_t *job, int sig) {
+	if (job->pgid > 0) {
+		kill(-job->pgid, sig);
+		return;
+	}
+	for (int i = 0; i < job->stage_count; i++)
+		if (job->states[i] != STAGE_DONE)
+			kill(job->pids[i], sig);
+}
+
+static void job_print(job_t *job, const char *state) {
+	printf("[%d]%c  %-24s%s\n", job->id, job == current_job() ? '+' : ' ', state, job->command);
+}
+
+// Waits until every stage of the job has finished or stopped. A foreground job
+// gets the terminal for that time. Call with SIGCHLD blocked; old_mask is the
+// mask to wait with (SIGCHLD unblocked). Returns true if the job finished, in
+// which case it is removed from the table and last_status is set.
+static bool job_wait(job_t *job, bool foreground, sigset_t *old_mask) {
+	if (foreground && job_control && job->pgid > 0)
+		tcsetpgrp(STDIN_FILENO, job->pgid);
+
+	clock_gettime(CLOCK_MONOTONIC, &job->pipes_sampled);
+	while (job_count_stages(job, STAGE_RUNNING) > 0) {
+		if (job->pipe_count == 0) {
+			sigsuspend(old_mask);
+			continue;
+		}
+		struct timespec interval = { 0, PIPE_SAMPLE_MS * 1000000L };
+		ppoll(NULL, 0, &interval, old_mask); // like sigsuspend(), with a timeout
+		pipes_sample(job);
+	}
+
+	if (foreground && job_control)
+		tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+	if (job_count_stages(job, STAGE_STOPPED) > 0) {
+		job->background = true;
+		printf("\n");
+		job_print(job, "Stopped");
+		return false;
+	}
+
+	last_status = job_exit_status(job);
+	if (job->pipe_stats)
+		pipes_report(job);
+	job_report_usage(job);
+	job_free(job);
+	return true;
+}
+
+// Either waits for a freshly started job or leaves it running in the background.
+// Call with SIGCHLD blocked.
+static void job_start(job_t *job, sigset_t *old_mask) {
+	if (job->stage_count == 0) { // nothing could be started
+		last_status = 127;
+		job_free(job);
+		return;
+	}
+	if (!job->background) {
+		job_wait(job, true, old_mask);
+		return;
+	}
+	if (interactive)
+		printf("[%d] %d\n", job->id, job->pids[job->stage_count - 1]);
+	last_status = 0;
+}
+
+// Reports background jobs that finished since the last prompt.
+void jobs_notify() {
+	sigset_t old_mask;
+	block_sigchld(&old_mask);
+	for (int j = 0; j < MAX_JOBS; j++) {
+		job_t *job = &jobs[j];
+		if (job->id == 0 || !job->background || job_count_stages(job, STAGE_DONE) != job->stage_count)
+			continue;
+		if (interactive) {
+			int status = job_exit_status(job);
+			if (status == 0) {
+				job_print(job, "Done");
+			} else {
+				char state[32];
+				snprintf(state, sizeof(state), "Exit %d", status);
+				job_print(job, state);
+			}
+		}
+		job_report_usage(job);
+		job_free(job);
+	}
+	restore_sigmask(&old_mask);
+}
+
+// jobs, fg, bg and wait. Returns the exit status.
+static int job_builtin(cmd_t *cmd) {
+	const char *arg = cmd->args[1];
+	sigset_t old_mask;
+	job_t *job;
+
+	if (cmd->builtin == BUILTIN_JOBS) {
+		block_sigchld(&old_mask);
+		for (int id = 1, left = MAX_JOBS; left > 0; id++) { // in job number order
+			left = 0;
+			for (int j = 0; j < MAX_JOBS; j++)
+				if (jobs[j].id >= id)
+					left++;
+			if ((job = find_job(id)) == NULL || !job->background)
+				continue;
+			if (job_count_stages(job, STAGE_DONE) == job->stage_count)
+				job_print(job, "Done");
+			else if (job_count_stages(job, STAGE_STOPPED) > 0)
+				job_print(job, "Stopped");
+			else
+				job_print(job, "Running");
+		}
+		restore_sigmask(&old_mask);
+		return 0;
+	}
+
+	if (cmd->builtin == BUILTIN_FG || cmd->builtin == BUILTIN_BG) {
+		bool fg = cmd->builtin == BUILTIN_FG;
+		block_sigchld(&old_mask);
+		job = job_from_arg(arg);
+		if (job == NULL) {
+			printf("- %s: no such job\n", cmd->name);
+			restore_sigmask(&old_mask);
+			return 1;
+		}
+		printf("%s\n", job->command);
+		for (int i = 0; i < job->stage_count; i++)
+			if (job->states[i] == STAGE_STOPPED)
+				job->states[i] = STAGE_RUNNING;
+		if (fg) {
+			job->background = false;
+			term_cooked();
+			if (job_control && job->pgid > 0)
+				tcsetpgrp(STDIN_FILENO, job->pgid); // before it wakes up and reads
+			job_signal(job, SIGCONT);
+			job_wait(job, true, &old_mask);
+		} else {
+			job->background = true;
+			job_signal(job, SIGCONT);
+		}
+		restore_sigmask(&old_mask);
+		return 0;
+	}
+
+	if (cmd->builtin == BUILTIN_WAIT) {
+		block_sigchld(&old_mask);
+		if (arg != NULL) {
+			if ((job = job_from_arg(arg)) == NULL)
+				printf("- wait: no such job\n");
+			else
+				job_wait(job, false, &old_mask);
+		} else {
+			// every running background job; stopped ones would never finish
+			for (int j = 0; j < MAX_JOBS; j++)
+				if (jobs[j].id != 0 && jobs[j].background && job_count_stages(&jobs[j], STAGE_STOPPED) == 0)
+					job_wait(&jobs[j], false, &old_mask);
+		}
+		restore_sigmask(&old_mask);
+		return 0;
+	}
+
+	return 1;
+}
+
+// User-space lsfd. Everything is read relative to directory descriptors (/proc,
+// /proc/<pid>/fd and /proc/<pid>/fdinfo) with openat() and readlinkat(), and
+// directories are listed with large getdents64() reads, so no path is built and
+// looked up from the root for every fd. Each fd's line is
+// "fd <n> -> <target> pos <pos> flags <open flags>", with pos and flags from fdinfo.
+// lsfd -a scans every process with a pool of threads; each thread formats into
+// its own buffer and the results are written out in PID order with writev().
+#define LSFD_DENTS_SIZE (64 * 1024) // bytes per getdents64() call
+#define LSFD_MAX_THREADS 16
+
+// Appends one line per open fd of pid to out, each prefixed with "pid <pid> " if
+// pid_prefix is set. Returns false with errno set if /proc/<pid>/fd cannot be opened.
+static bool lsfd_scan_pid(int proc_fd, const char *pid, bool pid_prefix, byte_buf_t *out) {
+	char path[64];
+	snprintf(path, sizeof(path), "%s/fd", pid);
+	int fd_dir = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd_dir == -1)
+		return false;
+	snprintf(path, sizeof(path), "%s/fdinfo", pid);
+	int info_dir = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	long dents[LSFD_DENTS_SIZE / sizeof(long)]; // long keeps the records aligned
+	char target[PATH_MAX], info[256], line[PATH_MAX + 128];
+	ssize_t n;
+	while ((n = getdents64(fd_dir, dents, sizeof(dents))) > 0) {
+		for (ssize_t off = 0; off < n; ) {
+			struct dirent64 *entry = (struct dirent64 *)((char *)dents + off);
+			off += entry->d_reclen;
+			if (entry->d_name[0] == '.') // skip the . and .. entries
+				continue;
+
+			ssize_t len = readlinkat(fd_dir, entry->d_name, target, sizeof(target) - 1);
+			if (len == -1) // closed in the meantime
+				continue;
+			target[len] = 0;
+
+			long long pos = 0;
+			unsigned int flags = 0;
+			int info_fd = info_dir == -1 ? -1 : openat(info_dir, entry->d_name, O_RDONLY | O_CLOEXEC);
+			if (info_fd != -1) {
+				ssize_t info_len = read(info_fd, info, sizeof(info) - 1);
+				close(info_fd);
+				if (info_len > 0) {
+					info[info_len] = 0;
+					sscanf(info, "pos: %lld flags: %o", &pos, &flags);
+				}
+			}
+
+			int line_len = snprintf(line, sizeof(line), "%s%s%sfd %s -> %s pos %lld flags 0%o\n",
+				pid_prefix ? "pid " : "", pid_prefix ? pid : "", pid_prefix ? " " : "",
+				entry->d_name, target, pos, flags);
+			buf_put(out, line, line_len < (int)sizeof(line) ? (size_t)line_len : sizeof(line) - 1);
+		}
+	}
+
+	if (info_dir != -1) close(info_dir);
+	close(fd_dir);
+	return true;
+}
+
+typedef struct lsfd_chunk_t {
+	int thread; // whose buffer holds this PID's lines
+	size_t off, len;
+} lsfd_chunk_t;
+
+typedef struct lsfd_scan_t {
+	int proc_fd;
+	char (*pids)[16];
+	int pid_count;
+	int next; // next index into pids, taken with an atomic add
+	byte_buf_t *bufs; // one per thread
+	lsfd_chunk_t *chunks; // one per PID
+} lsfd_scan_t;
+
+typedef struct lsfd_worker_t {
+	lsfd_scan_t *scan;
+	int id;
+} lsfd_worker_t;
+
+static void *lsfd_worker(void *arg) {
+	lsfd_worker_t *worker = arg;
+	lsfd_scan_t *scan = worker->scan;
+	byte_buf_t *buf = &scan->bufs[worker->id];
+	int i;
+	while ((i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED)) < scan->pid_count) {
+		size_t start = buf->len;
+		lsfd_scan_pid(scan->proc_fd, scan->pids[i], true, buf); // a process that exited meanwhile adds nothing
+		scan->chunks[i] = (lsfd_chunk_t) { worker->id, start, buf->len - start };
+	}
+	return NULL;
+}
+
+// lsfd -a <output file>: the fds of every process under /proc.
+static void lsfd_all(const char *file_name) {
+	int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (proc_fd == -1) {
+		perror("Cannot open /proc");
+		return;
+	}
+
+	lsfd_scan_t scan = { .proc_fd = proc_fd };
+	int capacity = 0;
+	long dents[LSFD_DENTS_SIZE / sizeof(long)];
+	ssize_t n;
+	while ((n = getdents64(proc_fd, dents, sizeof(dents))) > 0) {
+		for (ssize_t off = 0; off < n; ) {
+			struct dirent64 *entry = (struct dirent64 *)((char *)dents + off);
+			off += entry->d_reclen;
+			if (entry->d_name[0] < '1' || entry->d_name[0] > '9' || strlen(entry->d_name) >= sizeof(scan.pids[0]))
+				continue; // not a process
+			if (scan.pid_count == capacity) {
+				capacity = capacity ? capacity * 2 : 1024;
+				scan.pids = realloc(scan.pids, sizeof(scan.pids[0]) * capacity);
+			}
+			strcpy(scan.pids[scan.pid_count++], entry->d_name);
+		}
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus < 1 ? 1 : cpus > LSFD_MAX_THREADS ? LSFD_MAX_THREADS : cpus;
+	if (threads > scan.pid_count)
+		threads = scan.pid_count > 0 ? scan.pid_count : 1;
+	scan.bufs = calloc(threads, sizeof(byte_buf_t));
+	scan.chunks = calloc(scan.pid_count + 1, sizeof(lsfd_chunk_t));
+
+	pthread_t tids[LSFD_MAX_THREADS];
+	lsfd_worker_t workers[LSFD_MAX_THREADS];
+	int started = 0;
+	for (int t = 1; t < threads; t++) { // this thread is worker 0
+		workers[t] = (lsfd_worker_t) { &scan, t };
+		if (pthread_create(&tids[t], NULL, lsfd_worker, &workers[t]) != 0)
+			break;
+		started++;
+	}
+	workers[0] = (lsfd_worker_t) { &scan, 0 };
+	lsfd_worker(&workers[0]);
+	for (int t = 1; t <= started; t++)
+		pthread_join(tids[t], NULL);
+	close(proc_fd);
+
+	int out_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE);
+	if (out_fd == -1) {
+		perror("Cannot open output file");
+	} else {
+		struct iovec iov[IOV_MAX];
+		for (int i = 0; i < scan.pid_count; ) {
+			int count = 0;
+			size_t total = 0;
+			for (; i < scan.pid_count && count < IOV_MAX; i++) {
+				lsfd_chunk_t *c = &scan.chunks[i];
+				if (c->len == 0)
+					continue;
+				iov[count++] = (struct iovec) { scan.bufs[c->thread].data + c->off, c->len };
+				total += c->len;
+			}
+			if (count > 0 && writev(out_fd, iov, count) != (ssize_t)total) {
+				perror("lsfd: write");
+				break;
+			}
+		}
+		close(out_fd);
+	}
+
+	for (int t = 0; t < threads; t++)
+		free(scan.bufs[t].data);
+	free(scan.bufs);
+	free(scan.chunks);
+	free(scan.pids);
+}
+
+// lsfd -b <output file> <PID>...: asks the kernel module about every PID with one
+// binary batch query (see lsfd_abi.h) and formats the fixed-size records it
+// returns, instead of a write, a read and a text parse per PID.
+static void lsfd_batch(cmd_t *cmd) {
+	int count = cmd->arg_count - 4; // "lsfd", "-b", <output file>, PIDs..., NULL
+	if (count < 1 || count > LSFD_BATCH_MAX_PIDS) {
+		fprintf(stderr, "Usage: lsfd -b <output file> <PID>...\n");
+		return;
+	}
+
+	size_t req_len = sizeof(struct lsfd_batch_request) + count * sizeof(__s32);
+	struct lsfd_batch_request *req = malloc(req_len);
+	req->magic = LSFD_BATCH_MAGIC;
+	req->count = count;
+	for (int i = 0; i < count; i++)
+		req->pids[i] = atoi(cmd->args[3 + i]);
+
+	int fd = lsfd_module_open(); // kept open until the shell exits, see check_and_remove_module()
+	if (fd == -1) {
+		perror("Cannot open " PROC_PATH);
+		free(req);
+		return;
+	}
+	bool sent = write(fd, req, req_len) == (ssize_t)req_len && lseek(fd, 0, SEEK_SET) == 0;
+	free(req);
+	if (!sent) {
+		perror("lsfd: batch query failed");
+		return;
+	}
+
+	// the whole result, normally in a single read
+	size_t len = 0, cap = 1 << 20;
+	char *data = malloc(cap);
+	ssize_t n;
+	while ((n = read(fd, data + len, cap - len)) > 0) {
+		len += n;
+		if (len == cap)
+			data = realloc(data, cap *= 2);
+	}
+
+	struct lsfd_batch_header *header = (struct lsfd_batch_header *)data;
+	if (n == -1 || len < sizeof(*header) || header->magic != LSFD_BATCH_MAGIC ||
+		header->record_size != sizeof(struct lsfd_record) ||
+		header->strings_offset != sizeof(*header) + (size_t)header->record_count * sizeof(struct lsfd_record) ||
+		(size_t)header->strings_offset + header->strings_len > len) {
+		fprintf(stderr, "lsfd: unexpected reply from %s\n", PROC_PATH);
+		free(data);
+		return;
+	}
+
+	FILE *outfile = fopen(cmd->args[2], "w");
+	if (outfile == NULL) {
+		perror("Cannot open output file");
+		free(data);
+		return;
+	}
+
+	struct lsfd_record *records = (struct lsfd_record *)(data + sizeof(*header));
+	const char *strings = data + header->strings_offset;
+	for (__u32 i = 0; i < header->record_count; i++) {
+		struct lsfd_record *r = &records[i];
+		if (r->fd < 0) {
+			fprintf(outfile, "pid %d: no such process\n", r->pid);
+			continue;
+		}
+		bool has_path = r->path_len > 0 && (size_t)r->path_offset + r->path_len < header->strings_len;
+		fprintf(outfile, "pid %d fd %d -> %s pos %lld size %lld flags 0%o inode %llu dev %u:%u\n",
+			r->pid, r->fd, has_path ? strings + r->path_offset : "?",
+			(long long)r->pos, (long long)r->size, r->flags, (unsigned long long)r->inode,
+			major(r->dev), minor(r->dev));
+	}
+
+	fclose(outfile);
+	free(data);
+}
+
+#define BUILTIN_EXTERNAL -1 // returned by a builtin that wants the program run instead
+
+static int builtin_exit(cmd_t *cmd) {
+	(void)cmd;
+	/*
+	before exiting, check if this is the last slash instance
+	if it is, remove the module from kernel
+	*/
+	check_and_remove_module(); // call helper func to handle last slash instance
+	exit(0); // exit like normal
+}
+
+static int builtin_cd(cmd_t *cmd) {
+	if (cmd->arg_count > 0) {
+		if (chdir(cmd->args[1]) == -1) {
+			printf("- %s: %s  ---  %s\n", cmd->name, strerror(errno),cmd->args[1]);
+			return 1;
+		}
+		path_cache_chdir(); // relative PATH entries moved with us
+		prompt_invalidate(); // the prompt shows the directory
+	}
+	return 0;
+}
+
+static int builtin_hash(cmd_t *cmd) {
+	// hash         -> list the cached command locations
+	// hash -r      -> forget everything
+	// hash name... -> look the names up now so later runs hit the cache
+	if (cmd->arg_count == 2) {
+		path_cache_print();
+	} else if (strcmp(cmd->args[1], "-r") == 0) {
+		path_cache_clear();
+	} else {
+		char resolved[512];
+		for (int i = 1; cmd->args[i] != NULL; i++)
+			resolve_path(cmd->args[i], resolved);
+	}
+	return 0;
+}
+
+static int builtin_history(cmd_t *cmd) {
+	(void)cmd;
+	history_load();
+	for (int i = 0; i<history_count; ++i){
+		history_entry_t *e = history_entry(i);
+		printf("%d %.*s\n", i, (int)e->len, e->line);
+	}
+	return 0;
+}
+
+static int builtin_lsfd(cmd_t *cmd) {
+	if (cmd->args[1] != NULL && strcmp(cmd->args[1], "-b") == 0) {
+		lsfd_batch(cmd); // several PIDs at once through the kernel module
+		return 0;
+	}
+
+	if (cmd->args[1] != NULL && strcmp(cmd->args[1], "-a") == 0) {
+		if (cmd->arg_count != 4) { // "lsfd", "-a", <outputfile>, NULL
+			fprintf(stderr, "Usage: lsfd -a <output file>\n");
+			return 2;
+		}
+		lsfd_all(cmd->args[2]); // every process, in parallel
+		return 0;
+	}
+
+	// Check if the user provided exactly 2 arguments (PID and output file)
+	if (cmd->arg_count != 4) { // "lsfd", <pid>, <outputfile>, NULL
+            fprintf(stderr, "Usage: lsfd <PID> <output file>\n       lsfd -a <output file>\n       lsfd -b <output file> <PID>...\n");
+            return 2;
+    	}
+
+	int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	byte_buf_t out = { 0 };
+	if (proc_fd == -1 || !lsfd_scan_pid(proc_fd, cmd->args[1], false, &out)) {
+		perror("Cannot open /proc/<PID>/fd");
+		if (proc_fd != -1) close(proc_fd);
+		return 1;
+	}
+	close(proc_fd);
+
+	// Try to open the output file for writing
+	int out_fd = open(cmd->args[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, FILE_MODE);
+	if (out_fd == -1) {
+		perror("Cannot open output file");
+	} else {
+		if (out.len > 0 && write(out_fd, out.data, out.len) != (ssize_t)out.len)
+			perror("lsfd: write");
+		close(out_fd);
+	}
+	free(out.data);
+	return 0;
+
+}
+
+static bool is_identifier(const char *name, size_t len) {
+	if (len == 0 || isdigit((unsigned char)name[0]))
+		return false;
+	for (size_t i = 0; i < len; i++)
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+			return false;
+	return true;
+}
+
+// export NAME=value... sets environment variables, export alone lists them.
+static int builtin_export(cmd_t *cmd) {
+	if (cmd->args[1] == NULL) {
+		for (char **env = environ; *env != NULL; env++)
+			printf("export %s\n", *env);
+		return 0;
+	}
+	int status = 0;
+	for (int i = 1; cmd->args[i] != NULL; i++) {
+		char *arg = cmd->args[i];
+		char *eq = strchr(arg, '=');
+		size_t name_len = eq ? (size_t)(eq - arg) : strlen(arg);
+		if (!is_identifier(arg, name_len)) {
+			fprintf(stderr, "export: `%s': not a valid identifier\n", arg);
+			status = 1;
+			continue;
 		}
-		
-		// Try to open the output file for writing
-		FILE *outfile = fopen(cmd->args[2], "w");
-		if (outfile == NULL) {
-			perror("Cannot open output file");
-			closedir(dir); // close directory if error happens
-			return;
+		if (eq == NULL) // there are no unexported shell variables, nothing to do
+			continue;
+		*eq = 0;
+		setenv(arg, eq + 1, 1); // a changed PATH is noticed by path_cache_sync()
+		*eq = '=';
+	}
+	prompt_invalidate(); // the prompt shows $USER
+	return status;
+}
+
+// Prints the backslash escape at str (str[0] is the backslash) and returns the
+// last character it used. echo takes octal as \0nnn, printf as \nnn. Sets *stop
+// for \c, which ends all output.
+static const char *put_escape(const char *str, bool echo, bool *stop) {
+	static const char from[] = "abfnrtv\\", to[] = "\a\b\f\n\r\t\v\\";
+	const char *c = str + 1;
+	const char *known = *c ? strchr(from, *c) : NULL;
+	if (known != NULL) {
+		putchar(to[known - from]);
+		return c;
+	}
+	if (*c == 'c') {
+		*stop = true;
+		return c;
+	}
+	if (*c >= '0' && *c <= '7') {
+		if (echo && *c == '0')
+			c++;
+		int value = 0, digits = 0;
+		while (digits < 3 && *c >= '0' && *c <= '7') {
+			value = value * 8 + (*c++ - '0');
+			digits++;
 		}
+		putchar(value);
+		return c - 1;
+	}
+	putchar('\\'); // not an escape, print it as it is
+	return str;
+}
 
-		// Variables for reading the directory entries and resolving symbolic links
-		struct dirent *entry; // for reading directory
-		char link_path[1024]; // for resolving symbolic links
-		char link_target[1024];
-	
-		// Loop through each entry inside /proc/<PID>/fd
-		while ((entry = readdir(dir)) != NULL) {
-			if (entry->d_name[0] == '.') // skip the . and .. entries
+// echo [-neE] [arg...]
+static int builtin_echo(cmd_t *cmd) {
+	bool newline = true, escapes = false, stop = false;
+	int i = 1;
+	for (; cmd->args[i] != NULL && cmd->args[i][0] == '-' && cmd->args[i][1] != 0; i++) {
+		const char *opt = cmd->args[i] + 1;
+		if (strspn(opt, "neE") != strlen(opt)) // not an option, print it
+			break;
+		for (; *opt; opt++) {
+			if (*opt == 'n') newline = false;
+			if (*opt == 'e') escapes = true;
+			if (*opt == 'E') escapes = false;
+		}
+	}
+	for (int first = i; cmd->args[i] != NULL && !stop; i++) {
+		if (i > first)
+			putchar(' ');
+		if (!escapes) {
+			fputs(cmd->args[i], stdout);
+			continue;
+		}
+		for (const char *c = cmd->args[i]; *c && !stop; c++) {
+			if (*c == '\\')
+				c = put_escape(c, true, &stop);
+			else
+				putchar(*c);
+		}
+	}
+	if (newline && !stop)
+		putchar('\n');
+	return 0;
+}
+
+// printf format [arg...]: %s %b %c %d %i %u %o %x %X %e %f %g with flags, width
+// and precision. The format is reused while there are arguments left.
+static int builtin_printf(cmd_t *cmd) {
+	if (cmd->args[1] == NULL) {
+		fprintf(stderr, "printf: usage: printf format [arguments]\n");
+		return 2;
+	}
+	const char *format = cmd->args[1];
+	char **arg = cmd->args + 2;
+	bool stop = false;
+	char **start;
+	do {
+		start = arg;
+		for (const char *f = format; *f && !stop; f++) {
+			if (*f == '\\') {
+				f = put_escape(f, false, &stop);
 				continue;
-	
-			// Build the full path of the file descriptor link
-			snprintf(link_path, sizeof(link_path), "%s/%s", proc_fd_path, entry->d_name);
-	
-			// Read the target that the symbolic link points to
-			ssize_t len = readlink(link_path, link_target, sizeof(link_target) - 1);
-			if (len == -1) {
-				// if the symbolic link can't be read skip it
+			}
+			if (*f != '%') {
+				putchar(*f);
 				continue;
 			}
-	
-			link_target[len] = '\0'; // null terminate link target
-	
-			// Write the fd and its resolved target into the output file
-			fprintf(outfile, "fd %s -> %s\n", entry->d_name, link_target);
+			if (f[1] == '%') {
+				putchar('%');
+				f++;
+				continue;
+			}
+
+			// copy the conversion: flags, width, precision
+			char spec[32];
+			size_t n = 0;
+			spec[n++] = *f++;
+			while (*f && strchr("-+ #0", *f) && n < 8)
+				spec[n++] = *f++;
+			while (isdigit((unsigned char)*f) && n < 16)
+				spec[n++] = *f++;
+			if (*f == '.') {
+				spec[n++] = *f++;
+				while (isdigit((unsigned char)*f) && n < 24)
+					spec[n++] = *f++;
+			}
+			if (*f == 0)
+				break;
+			const char *value = *arg != NULL ? *arg++ : NULL;
+			switch (*f) {
+			case 's':
+				spec[n++] = 's'; spec[n] = 0;
+				printf(spec, value ? value : "");
+				break;
+			case 'b': // the argument with its escapes expanded
+				for (const char *c = value ? value : ""; *c && !stop; c++) {
+					if (*c == '\\')
+						c = put_escape(c, true, &stop);
+					else
+						putchar(*c);
+				}
+				break;
+			case 'c':
+				if (value && value[0]) {
+					spec[n++] = 'c'; spec[n] = 0;
+					printf(spec, value[0]);
+				}
+				break;
+			case 'd': case 'i':
+				spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = 'd'; spec[n] = 0;
+				printf(spec, value ? strtoll(value, NULL, 0) : 0LL);
+				break;
+			case 'u': case 'o': case 'x': case 'X':
+				spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = *f; spec[n] = 0;
+				printf(spec, value ? strtoull(value, NULL, 0) : 0ULL);
+				break;
+			case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+				spec[n++] = *f; spec[n] = 0;
+				printf(spec, value ? strtod(value, NULL) : 0.0);
+				break;
+			default:
+				fprintf(stderr, "printf: %%%c: invalid directive\n", *f);
+				return 1;
+			}
 		}
-	
-		// Clean up on aisle 4
-		fclose(outfile); // Close output file
-		closedir(dir); // Close directory
-	
-	
-		return; // to continue running shell
+	} while (*arg != NULL && arg != start && !stop);
+	return 0;
+}
+
+static int builtin_pwd(cmd_t *cmd) {
+	(void)cmd;
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("pwd");
+		return 1;
+	}
+	puts(cwd);
+	return 0;
+}
+
+static int builtin_true(cmd_t *cmd) {
+	(void)cmd;
+	return 0;
+}
+
+static int builtin_false(cmd_t *cmd) {
+	(void)cmd;
+	return 1;
+}
+
+// test with one operator: 0 true, 1 false, 2 error.
+static int test_unary(const char *op, const char *arg) {
+	struct stat st;
+	if (strcmp(op, "-z") == 0) return arg[0] != 0;
+	if (strcmp(op, "-n") == 0) return arg[0] == 0;
+	if (strcmp(op, "-r") == 0) return access(arg, R_OK) != 0;
+	if (strcmp(op, "-w") == 0) return access(arg, W_OK) != 0;
+	if (strcmp(op, "-x") == 0) return access(arg, X_OK) != 0;
+	if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+	if (op[0] != '-' || op[1] == 0 || op[2] != 0 || !strchr("efdsp", op[1])) {
+		fprintf(stderr, "test: %s: unary operator expected\n", op);
+		return 2;
+	}
+	if (stat(arg, &st) != 0) return 1;
+	switch (op[1]) {
+	case 'f': return !S_ISREG(st.st_mode);
+	case 'd': return !S_ISDIR(st.st_mode);
+	case 's': return st.st_size == 0;
+	case 'p': return !S_ISFIFO(st.st_mode);
+	default: return 0; // -e
+	}
+}
+
+static int test_binary(const char *left, const char *op, const char *right) {
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(left, right) != 0;
+	if (strcmp(op, "!=") == 0) return strcmp(left, right) == 0;
+
+	static const char *int_ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+	for (int i = 0; i < 6; i++) {
+		if (strcmp(op, int_ops[i]) != 0)
+			continue;
+		char *end_l, *end_r;
+		long long l = strtoll(left, &end_l, 10), r = strtoll(right, &end_r, 10);
+		if (*left == 0 || *end_l != 0 || *right == 0 || *end_r != 0) {
+			fprintf(stderr, "test: integer expression expected\n");
+			return 2;
+		}
+		bool result[] = { l == r, l != r, l < r, l <= r, l > r, l >= r };
+		return !result[i];
+	}
+	fprintf(stderr, "test: %s: binary operator expected\n", op);
+	return 2;
+}
+
+static int test_eval(char **args, int count) {
+	if (count >= 2 && strcmp(args[0], "!") == 0) {
+		int result = test_eval(args + 1, count - 1);
+		return result == 2 ? 2 : !result;
+	}
+	switch (count) {
+	case 0: return 1;
+	case 1: return args[0][0] == 0;
+	case 2: return test_unary(args[0], args[1]);
+	case 3: return test_binary(args[0], args[1], args[2]);
+	}
+	fprintf(stderr, "test: too many arguments\n");
+	return 2;
+}
+
+// test expr and [ expr ]: file tests, string and integer comparisons, !
+static int builtin_test(cmd_t *cmd) {
+	int count = cmd->arg_count - 2; // without the name and the NULL
+	if (cmd->name[0] == '[') {
+		if (count == 0 || strcmp(cmd->args[count], "]") != 0) {
+			fprintf(stderr, "[: missing `]'\n");
+			return 2;
+		}
+		count--;
+	}
+	return test_eval(cmd->args + 1, count);
+}
+
+// sleep number[smhd]...; at the prompt the real sleep runs instead, where Ctrl-C
+// stops the program and not the shell
+static int builtin_sleep(cmd_t *cmd) {
+	if (!running_script && job_control)
+		return BUILTIN_EXTERNAL;
+	double seconds = 0;
+	for (int i = 1; cmd->args[i] != NULL; i++) {
+		char *end;
+		double value = strtod(cmd->args[i], &end);
+		double unit = *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : 1;
+		if (end == cmd->args[i] || value < 0 || (*end != 0 && (strchr("smhd", *end) == NULL || end[1] != 0))) {
+			fprintf(stderr, "sleep: invalid time interval '%s'\n", cmd->args[i]);
+			return 1;
+		}
+		seconds += value * unit;
+	}
+	if (cmd->args[1] == NULL) {
+		fprintf(stderr, "sleep: missing operand\n");
+		return 1;
+	}
+	struct timespec left = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+	while (nanosleep(&left, &left) == -1 && errno == EINTR)
+		; // SIGCHLD of a background job, keep sleeping
+	return 0;
+}
+
+// "cat file... > out": copy in-process with copy_fd() instead of starting cat.
+// Only when it reads files and does not write to the terminal, so it neither
+// waits for keyboard input nor runs for long where Ctrl-C would hit the shell.
+static int builtin_cat(cmd_t *cmd) {
+	if (!is_plain_cat(cmd) || (cmd->args[1] == NULL && !cmd->redirects[0] && !cmd->here_doc) || isatty(STDOUT_FILENO))
+		return BUILTIN_EXTERNAL;
+	if (cmd->args[1] != NULL)
+		return cat_files(cmd->args + 1, STDOUT_FILENO);
+	return copy_fd(STDIN_FILENO, STDOUT_FILENO) == 0 ? 0 : 1;
+}
+
+static int (*const builtin_handlers[BUILTIN_COUNT])(cmd_t *cmd) = {
+	[BUILTIN_EXIT] = builtin_exit, [BUILTIN_CD] = builtin_cd, [BUILTIN_HISTORY] = builtin_history,
+	[BUILTIN_HASH] = builtin_hash, [BUILTIN_LSFD] = builtin_lsfd, [BUILTIN_JOBS] = job_builtin,
+	[BUILTIN_FG] = job_builtin, [BUILTIN_BG] = job_builtin, [BUILTIN_WAIT] = job_builtin,
+	[BUILTIN_EXPORT] = builtin_export, [BUILTIN_ECHO] = builtin_echo, [BUILTIN_PRINTF] = builtin_printf,
+	[BUILTIN_PWD] = builtin_pwd, [BUILTIN_TRUE] = builtin_true, [BUILTIN_FALSE] = builtin_false,
+	[BUILTIN_TEST] = builtin_test, [BUILTIN_SLEEP] = builtin_sleep, [BUILTIN_CAT] = builtin_cat,
+};
+
+// Runs a builtin in the shell. Its redirect files are installed as the shell's
+// own stdin/stdout for as long as it runs. Returns false if the builtin asked
+// for the program to be run instead.
+static bool run_builtin(cmd_t *cmd) {
+	int redirect_fds[2];
+	if (!open_redirects(cmd, redirect_fds)) {
+		last_status = 1;
+		return true;
+	}
+
+	fflush(stdout); // what was printed before goes to the old stdout
+	int saved_fds[2] = { -1, -1 };
+	for (int fd = 0; fd < 2; fd++) {
+		if (redirect_fds[fd] == -1)
+			continue;
+		saved_fds[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10); // -1 if fd was not open
+		dup2(redirect_fds[fd], fd);
+		close(redirect_fds[fd]);
+	}
+
+	bool account = accounting_enabled();
+	struct timespec started, ended;
+	struct rusage usage, usage_before;
+	if (account) {
+		clock_gettime(CLOCK_MONOTONIC, &started);
+		getrusage(RUSAGE_SELF, &usage_before);
+	}
+
+	int status = builtin_handlers[cmd->builtin](cmd);
+
+	if (account && status != BUILTIN_EXTERNAL) {
+		clock_gettime(CLOCK_MONOTONIC, &ended);
+		getrusage(RUSAGE_SELF, &usage);
+		rusage_sub(&usage, &usage_before);
+		char *command = command_text(cmd);
+		account_command(command, status, timespec_seconds(&started, &ended), &usage, NULL);
+		free(command);
+	}
+
+	fflush(stdout);
+	for (int fd = 0; fd < 2; fd++) {
+		if (redirect_fds[fd] == -1)
+			continue;
+		if (saved_fds[fd] != -1) {
+			dup2(saved_fds[fd], fd);
+			close(saved_fds[fd]);
+		} else {
+			close(fd);
+		}
+	}
+
+	if (status == BUILTIN_EXTERNAL)
+		return false;
+	last_status = status;
+	return true;
+}
+
+// time <command>: runs the command, which may be a pipeline, and prints its
+// real time, user and system CPU time, peak RSS and context switches to stderr,
+// one line per stage of a pipeline and then the total. A background job reports
+// when it finishes. A builtin that runs in the shell is measured with getrusage(),
+// without a peak RSS of its own.
+static void time_command(cmd_t *cmd) {
+	if (cmd->args[1] == NULL) {
+		last_status = 0;
+		return;
+	}
+	cmd_t timed = *cmd; // the same stage without the "time" word
+	timed.name = cmd->args[1];
+	timed.args = cmd->args + 1;
+	timed.arg_count--;
+	timed.builtin = builtin_lookup(timed.name);
+
+	struct timespec started, ended;
+	struct rusage usage, usage_before;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	getrusage(RUSAGE_SELF, &usage_before);
+	time_requested = true;
+	time_reported = false;
+	process_command(&timed);
+	time_requested = false;
+	if (time_reported || timed.background)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ended);
+	getrusage(RUSAGE_SELF, &usage);
+	rusage_sub(&usage, &usage_before);
+	usage_print(timed.name, timespec_seconds(&started, &ended), &usage);
+}
+
+// Command substitution. The command of a $(...) runs in a forked copy of the
+// shell, through process_command() like any other line, so a cd or exit in it
+// leaves this shell alone and nested $(...)s are expanded by the copy. Its
+// stdout is a pipe that we read while it runs, at least SUBST_READ / 2 bytes
+// per read, into a buffer that doubles when it fills up: MBs of output take
+// linear time and no temporary file. Trailing newlines are dropped.
+#define SUBST_READ (64 * 1024)
+
+char *command_output(const char *command, size_t len, size_t *output_len) {
+	size_t capacity = SUBST_READ, used = 0;
+	char *output = malloc(capacity);
+	*output_len = 0;
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return output;
+	}
+	long pipe_size = pipe_size_setting(); // SLASH_PIPESIZE, like pipeline pipes
+	if (pipe_size > 0)
+		pipe_set_size(fds[WRITE_END], pipe_size);
+
+	// SIGCHLD stays blocked until we reaped the copy ourselves, the handler would not know its pid
+	sigset_t old_mask;
+	block_sigchld(&old_mask);
+	term_cooked(); // the command may read the terminal
+	pid_t pid = fork_child(STDIN_FILENO, fds[WRITE_END], -1, false);
+	if (pid == 0) {
+		close(fds[READ_END]);
+		job_control = false; // it belongs to the line that is running
+		interactive = false;
+		arena_t arena = { 0 };
+		process_command(parse_line(command, len, &arena));
+		fflush(stdout);
+		_exit(last_status);
+	}
+	close(fds[WRITE_END]);
+	if (pid == -1) {
+		perror("fork");
+	} else {
+		ssize_t n;
+		while ((n = read(fds[READ_END], output + used, capacity - used)) != 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1)
+				break;
+			used += n;
+			if (capacity - used < SUBST_READ / 2) {
+				capacity *= 2;
+				output = realloc(output, capacity);
+			}
+		}
+		while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+	close(fds[READ_END]);
+	restore_sigmask(&old_mask);
+
+	while (used > 0 && output[used - 1] == '\n')
+		used--;
+	*output_len = used;
+	return output;
+}
+
+// The command a line with $(...) stands for when it runs now (see lex_subst_t).
+// The substitutions cannot add stages, so the here-documents already read for
+// the parsed line carry over stage by stage.
+static cmd_t *expand_command(cmd_t *cmd, arena_t *arena) {
+	lex_subst_t subst = { .mode = SUBST_RUN };
+	int len = strlen(cmd->source);
+	token_t *tokens;
+	lex_line(cmd->source, len, arena, &tokens, &subst);
+
+	subst.mode = SUBST_INSERT;
+	cmd_t *expanded = parse_line_subst(cmd->source, len, arena, &subst);
+	for (cmd_t *c = cmd, *e = expanded; c != NULL && e != NULL; c = c->next, e = e->next) {
+		if (e->here_end != NULL) {
+			e->here_doc = c->here_doc;
+			e->here_end = NULL;
+		}
+	}
+
+	for (int i = 0; i < subst.count; i++)
+		free(subst.outputs[i]);
+	free(subst.outputs);
+	free(subst.lengths);
+	return expanded;
+}
+
+void process_command( cmd_t *cmd) {
+
+	if (cmd->source != NULL && !cmd->auto_complete) {
+		static arena_t expand_arena;
+		cmd_t *expanded = expand_command(cmd, &expand_arena);
+		process_command(expanded); // has no source, the $(...)s are gone
+		arena_reset(&expand_arena);
+		return;
+	}
+
+	for (cmd_t *c = cmd; c != NULL; c = c->next)
+		if (c->redirect_error)
+			printf("ERROR! : No filename provided after redirection symbol\n");
+
+    // built-ins
+	if (strcmp(cmd->name, "") == 0) return;
+
+	if (cmd->builtin == BUILTIN_TIME && !cmd->auto_complete) {
+		time_command(cmd);
+		return;
 	}
 
+	// Builtins that only make sense in the shell always run here. The ones that
+	// also exist as programs (echo, test, ...) only as a single foreground command
+	// that is not being completed; in a pipeline or with & the program runs.
+	if (cmd->builtin != BUILTIN_NONE &&
+		(cmd->builtin < BUILTIN_FIRST_UTILITY || (cmd->next == NULL && !cmd->background && !cmd->auto_complete))) {
+		if (run_builtin(cmd))
+			return;
+	}
 
     // TODO: implement other builtin commands here
     // do not forget to return from this method if cmd was a built-in and already processed
@@ -669,100 +3808,55 @@ void process_command( cmd_t *cmd) {
 		cmd->name[strlen(cmd->name) - 1] = 0;
 	}
 
-    char *tab_path_env = getenv("PATH"); // we obtain the "PATH" environment variable of the user.
-	if (tab_path_env == NULL) {
+	// The executables on PATH are kept in a sorted index (see exe_index_sync), so
+	// completing is a binary search for the typed prefix instead of reading every
+	// PATH directory again.
+	if (!exe_index_sync()) {
 		printf("ERROR! : Your PATH environment variable was not set. Please do not try to use the autocomplete functionality.");
 		return;
 	}
 
-	char *tab_path_copy = strdup(tab_path_env);
-	char *tab_curr_directory = strtok(tab_path_copy, ":");
-	char **matching_exes = malloc(sizeof(char *) * MAX_MATCHES); // This array contains the executable files with a name 
-								     // that matches what the user has typed. We set this array to have
-								     // at most 256 matches.
-	int match_count = 0;
-
-	while (tab_curr_directory != NULL) {
-		DIR *directory = opendir(tab_curr_directory);
-		if (directory) {
-			struct dirent *entry;
-			while ((entry = readdir(directory)) != NULL) {
-				char tab_full_path[512];
-				if (strncmp(entry->d_name, cmd->name, strlen(cmd->name)) == 0) { // If the first characters of the executable
-												 // file name match the user's input,:
-					bool already_in_array = false; // bool variable to ensure that the same file isn't written more than once.
-					for (int i = 0; i < match_count; i++) { // checks if the entry is already in the array. if yes, it stops.
-						if (strcmp(matching_exes[i], entry->d_name) == 0) {
-							already_in_array = true;
-							break;
-						}
-					}		
-					snprintf(tab_full_path, sizeof(tab_full_path), "%s/%s", tab_curr_directory, entry->d_name);
-					if (access(tab_full_path, X_OK) == 0 && !already_in_array) { // If the file is executable, and if it
-												     // is not already in the matches array,:
-						char command_full_path[512];
-						snprintf(command_full_path, sizeof(command_full_path), "%s/%s", tab_curr_directory, cmd->name);
-						// Checks for the case when the user has already typed the full command name.
-						// If so, the files within the user's current directory will be displayed.
-						if (strcmp(tab_full_path, command_full_path) == 0) {
-							DIR *user_directory = opendir(".");
-							if (user_directory) {
-								printf("\n");
-								struct dirent *dir_entry;
-								while ((dir_entry = readdir(user_directory)) != NULL) {
-									printf("%s\n", dir_entry->d_name);
-									}
-								closedir(user_directory);
-								free(tab_path_copy);
-								return;
-							}
-						}
-						// Adds the matching command name to the matching executable files directory.
-						matching_exes[match_count] = malloc(strlen(entry->d_name) + 1);
-						strcpy(matching_exes[match_count], entry->d_name);
-						match_count++;
-
-					}
-				}
+	int first_match;
+	int match_count = exe_index_lookup(cmd->name, &first_match);
+
+	// Checks for the case when the user has already typed the full command name.
+	// If so, the files within the user's current directory will be displayed.
+	// The exact name sorts before every longer name with the same prefix.
+	if (match_count > 0 && strcmp(exe_index[first_match], cmd->name) == 0) {
+		DIR *user_directory = opendir(".");
+		if (user_directory) {
+			printf("\n");
+			struct dirent *dir_entry;
+			while ((dir_entry = readdir(user_directory)) != NULL) {
+				printf("%s\n", dir_entry->d_name);
 			}
+			closedir(user_directory);
+			return;
 		}
-		closedir(directory);
-		tab_curr_directory = strtok(NULL, ":");
 	}
 
-	free(tab_path_copy);
-
 	printf("\n");
 	
-	// No matches in the matches array.
+	// No matches in the index.
 	if (match_count == 0) {
 		printf("No matches found!\n");
-		free(matching_exes);
 		return;
 	}
 	
-	// If there is only a single element in the array, this means that the command can be auto completed.
+	// If there is only a single match, this means that the command can be auto completed.
 	if (match_count == 1) {
-		snprintf(autocomplete_buf, sizeof(autocomplete_buf), "%s", matching_exes[0]); // Fills the autocomplete buffer, which is used
+		snprintf(autocomplete_buf, sizeof(autocomplete_buf), "%s", exe_index[first_match]); // Fills the autocomplete buffer, which is used
 											      // in the "prompt" function.
-		free(matching_exes[0]);
-		free(matching_exes);
 		return;
 	}
 
 	// Otherwise, if there are multiple matches, prints every match found.
-	for (int i=0; i < match_count; i++) {
-		printf("%s\n", matching_exes[i]);
+	for (int i = first_match; i < first_match + match_count; i++) {
+		printf("%s\n", exe_index[i]);
 	}
 
 	fflush(stdout);
 
-	for (int i=0; i < match_count; i++) {
-		free(matching_exes[i]);
-	}
-
-	free(matching_exes);
-
         return;
     }
 
@@ -772,79 +3866,148 @@ void process_command( cmd_t *cmd) {
 		int input_fd = STDIN_FILENO; // to keep track of where each process takes input from
 		cmd_t *current = cmd;
 
+		// SIGCHLD stays blocked until every stage is registered in the job, so a stage
+		// cannot be reaped before we know its pid (and the group leader stays around
+		// as a zombie for the later stages to join its process group).
+		sigset_t old_mask;
+		block_sigchld(&old_mask);
+		job_t *job = job_create(cmd);
+		if (job == NULL) {
+			restore_sigmask(&old_mask);
+			return;
+		}
+
+		long pipe_size = pipe_size_setting();
+		char *pipe_stats = getenv("SLASH_PIPESTATS");
+		job->pipe_auto = pipe_size == -1;
+		job->pipe_stats = pipe_stats != NULL && pipe_stats[0] != 0 && strcmp(pipe_stats, "0") != 0;
+		if (!job->background && (job->pipe_auto || job->pipe_stats)) {
+			int stages = 0;
+			for (cmd_t *c = cmd; c != NULL; c = c->next)
+				stages++;
+			job->pipes = malloc(sizeof(pipe_stat_t) * stages); // at most one pipe per stage
+		}
+		pipe_stat_t *input_pipe = NULL; // watched pipe the current stage reads
+
 		while (current != NULL){ // start loop for multiple pipes
+			cmd_t *next = current->next;
+
+			// "cat file | ...", "cat < file | ..." or "cat <<EOF | ...": instead of a
+			// cat process copying the file into a pipe, the next stage gets the file
+			// (or the here-document's memfd) itself as stdin. For several files a
+			// forked shell (no exec) splices them into the pipe. Not for a job that is
+			// timed, accounted or has pipe stats: there the cat stage has to show up.
+			bool cat_stdin = current->redirects[0] != NULL || current->here_doc != NULL;
+			bool cat_redirect = current->args[1] == NULL && cat_stdin;
+			if (current == cmd && next != NULL && is_plain_cat(current) && (current->args[1] != NULL || cat_redirect) &&
+				!(current->args[1] != NULL && cat_stdin) && !current->redirects[1] && !current->redirects[2] &&
+				!job->timed && !job->pipe_stats && !accounting_enabled()) {
+				if (cat_redirect || current->args[2] == NULL) {
+					int file_fd = current->here_doc ? here_doc_fd(current->here_doc) :
+						open(cat_redirect ? current->redirects[0] : current->args[1], O_RDONLY | O_CLOEXEC);
+					struct stat file_st;
+					if (file_fd != -1 && (fstat(file_fd, &file_st) == -1 || !S_ISREG(file_st.st_mode))) {
+						close(file_fd); // a directory, FIFO or device: the real cat deals with it
+						file_fd = -1;
+					}
+					if (file_fd != -1) {
+						input_fd = file_fd;
+						current = next;
+						continue;
+					} // else let the real cat report the error
+				} else {
+					int pumpFd[2];
+					if (pipe2(pumpFd, O_CLOEXEC) == 0) {
+						pid_t pid = fork_child(STDIN_FILENO, pumpFd[WRITE_END], job->pgid, !job->background);
+						if (pid == 0)
+							_exit(cat_files(current->args + 1, STDOUT_FILENO));
+						if (pid > 0)
+							job_add_stage(job, pid, "cat");
+						close(pumpFd[WRITE_END]);
+						input_fd = pumpFd[READ_END];
+						current = next;
+						continue;
+					}
+				}
+			}
 		
 			// first, resolve path  
 			char path_to_execute[512];
 			if (!resolve_path(current->name, path_to_execute)){
 				// couldn't locate the current command
-				current = current->next; // normal linux terminal still continued when there was a unlocatable command in the piping, it showed ouput when there was a valid command at the end
+				current = next; // normal linux terminal still continued when there was a unlocatable command in the piping, it showed ouput when there was a valid command at the end
 				continue;
 			}
 
+			// "sort < in.csv | uniq > out.txt": a file redirect takes the place of the
+			// stage's pipe end (or the terminal), so the data goes from disk to disk
+			// without cat or tee stages. The pipe to the next stage is still made; a
+			// stage whose stdout went to a file, or that is not started because a
+			// redirect file cannot be opened, just leaves the next one at EOF.
+			int redirect_fds[2];
+			bool redirects_opened = open_redirects(current, redirect_fds);
+
 			int pipeFd[2]; // create file descriptor
+			int output_fd = STDOUT_FILENO; // where the current command writes to
 
-			if (current->next != NULL){ // create a pipe if there is still a next command -> meaning there is still a "|" remaining on right side of our command
-				if (pipe(pipeFd) == -1){ 
+			if (next != NULL){ // create a pipe if there is still a next command -> meaning there is still a "|" remaining on right side of our command
+				// close-on-exec, so no child keeps a stray copy of a pipe end (which would keep the reader from seeing EOF)
+				if (pipe2(pipeFd, O_CLOEXEC) == -1){ 
 					fprintf(stderr, "Pipe failed");
 					exit(1); // exit failure
 				} // else, create pipe
+				if (pipe_size > 0)
+					pipe_set_size(pipeFd[WRITE_END], pipe_size);
+				output_fd = pipeFd[WRITE_END]; // output of current command is sent to next (right) command
 			}
-		
 
-			// Create a new child process for the current command
-			pid_t pidP = fork(); 
-
-			if (pidP < 0) { // fork failed
-				fprintf(stderr, "Fork failed");
-				exit(1);
+			// Start the current command with stdin replaced by the previous command's output
+			// (input_fd is updated for each next command at the end of the loop) and
+			// stdout replaced by the write end of the new pipe.
+			pid_t pid = -1;
+			if (redirects_opened) {
+				pid = launch_command(path_to_execute, current->args,
+					redirect_fds[0] != -1 ? redirect_fds[0] : input_fd, redirect_fds[1] != -1 ? redirect_fds[1] : output_fd,
+					job->pgid, !job->background && job->stage_count == 0);
+				if (redirect_fds[0] != -1) close(redirect_fds[0]);
+				if (redirect_fds[1] != -1) close(redirect_fds[1]);
 			}
-
-			else if (pidP == 0) {
-				// CHILD 
-				if (input_fd != STDIN_FILENO){ // handle input redirection
-					dup2(input_fd, STDIN_FILENO); // if input shouln't be coming from keyboard(STDIN_FILENO) make it come from previous command's output
-					// input_fd is updated for each next command at the end of the loop
-					// dup2 makes STDIN_FILENO be a copy of input_fd -> replace stdin with whatever input_fd is pointing to
-					close(input_fd); // after duplicating input_fd, it is not needed, so we close it 
-				}
-
-				if (current->next != NULL){ // handle output redirection, if there is a next command connect stdout to the pipe's write end
-					close(pipeFd[READ_END]); // close read end of pipe for left command
-					dup2(pipeFd[WRITE_END], STDOUT_FILENO); // redirect stdout to write end of left command
-					// replace stdout with write end of pipe -> output of current command is sent to next (right) command
-					close(pipeFd[WRITE_END]); // close write end of pipe for left command since we already duplicated it 
-				}
-
-				execv(path_to_execute, current->args); // execute current command
-				// if exec fails
+			if (pid != -1) {
+				job_add_stage(job, pid, current->name);
+				if (input_pipe != NULL && redirect_fds[0] == -1) // with < file the pipe has no reader
+					input_pipe->reader = job->stage_count - 1;
+			} else if (redirects_opened) {
 				if (strcmp(current->name, "") == 0) {
-					printf("ERROR! : empty command after pipe");
+					printf("ERROR! : empty command after pipe\n");
 				}
 				else{
 					printf("execv for pipe command failed -> command name: %s\n", current->name);
-				exit(1); 
 				}
-				
 			}
 
-			else if (pidP > 0) {
-				// PARENT
+			// PARENT
+			if (input_fd != STDIN_FILENO){ 
+				close(input_fd); // if input_fd was an earlier pipe, close it
+			}
 
-				if (input_fd != STDIN_FILENO){ 
-					close(input_fd); // if input_fd was an earlier pipe, close it
-				}
+			if (input_pipe != NULL)
+				pipe_unwatch(input_pipe); // only if its reader did not start
+			input_pipe = NULL;
 
-				if (current->next != NULL){ // set up input_fd for next command
-					close(pipeFd[WRITE_END]); // parent no longer needs the write-end
-					input_fd = pipeFd[READ_END]; // to change stdin next command -> next command will read from the output of the current command
-				}
+			if (next != NULL){ // set up input_fd for next command
+				close(pipeFd[WRITE_END]); // parent no longer needs the write-end
+				input_fd = pipeFd[READ_END]; // to change stdin next command -> next command will read from the output of the current command
+				if (job->pipes != NULL)
+					input_pipe = pipe_watch(job, input_fd, pid != -1 ? job->stage_count - 1 : -1);
 			}
 			
-			current = current->next; // move to the next command in the pipeline
+			current = next; // move to the next command in the pipeline
 		}
-		// after forking all processes, parent waits 
-		while (wait(NULL) > 0);
+		if (input_pipe != NULL)
+			pipe_unwatch(input_pipe); // the last stages could not be started
+		// after starting all processes, parent waits for exactly this job's stages (or not at all for &)
+		job_start(job, &old_mask);
+		restore_sigmask(&old_mask);
 	
 		return; // to stop continuing since we did execv inside the block -> to avoid extra fork/exec
     }
@@ -855,8 +4018,8 @@ void process_command( cmd_t *cmd) {
         //printf("\nStdIn/StdOut redirection not implemented yet!\n");
         //return;
 
-		// redirection is done after forking to protect parent(shell) code
-		// after fork, we redirect stdout/stdin to a file in the child process 
+		// the redirect files are opened by open_redirects() and only installed as
+		// stdin/stdout in the child process, which protects the parent(shell) code
 
 		// before fork, check for filename missing case
 		if ((strcmp(cmd->name, "")) == 0) return; // cmd name is set to \0 inside parser func when filename is missing
@@ -868,75 +4031,438 @@ void process_command( cmd_t *cmd) {
     char path_to_execute[512]; // path resolution using custom helper function resolve_path
 
 	if (!resolve_path(cmd->name, path_to_execute)){ // couldn't locate the command
+		last_status = 127;
 		return;
 	}
 	 
 
     // Command is not a builtin then
-	pid_t pid = fork();
-	
-	if (pid == 0) {
-        // CHILD
+	int redirect_fds[2];
+	if (!open_redirects(cmd, redirect_fds))
+		return;
 
-        // This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
+	int in_fd = redirect_fds[0] != -1 ? redirect_fds[0] : STDIN_FILENO;
+	int out_fd = redirect_fds[1] != -1 ? redirect_fds[1] : STDOUT_FILENO;
 
-		if (cmd->redirects[0]){ // for the < case
-			int fd = open(cmd->redirects[0], O_RDONLY); // Open the file for reading 
-		 
-			if (fd == -1){ // open() failed
-				printf("ERROR! : Problem about input redirection (<)");
-				exit(1);
-			}
+	// TODO: implement exec for the resolved path using execv()
+	// execvp(cmd->name, cmd->args); // <- DO NOT USE THIS, replace it with execv()
+	sigset_t old_mask;
+	block_sigchld(&old_mask);
+	job_t *job = job_create(cmd);
+	pid_t pid = -1;
+	if (job != NULL)
+		pid = launch_command(path_to_execute, cmd->args, in_fd, out_fd, job->pgid, !job->background); // Loads the located file into a child process for execution.
 
-			dup2(fd, STDIN_FILENO); // redirect stdin to the file
-			close(fd); // close file descriptor 
-		}
+	// the child has its own copies of the redirect files now
+	if (redirect_fds[0] != -1) close(redirect_fds[0]);
+	if (redirect_fds[1] != -1) close(redirect_fds[1]);
+
+	if (job == NULL) {
+		restore_sigmask(&old_mask);
+		return;
+	}
+	if (pid == -1) {
+        // if exec fails print error message
+		printf("ERROR! : Failed to execute command: %s\n", cmd->name);
+	} else {
+		job_add_stage(job, pid, cmd->name);
+	}
+
+	// PARENT
+	job_start(job, &old_mask); // wait for child process to finish, unless it runs in the background
+	restore_sigmask(&old_mask);
+}
+
+// Parallel script mode (slash -j N script.sh). Script lines are independent
+// commands unless a barrier line says otherwise, so up to max_jobs of them run
+// at once, each in a forked copy of the shell that calls process_command().
+// A line's stdout and stderr go to two memfds and are copied out in script order
+// once the line and every line before it finished, so the output looks exactly
+// like a sequential run. Barrier lines (wait, and the builtins that change the
+// shell itself: cd, exit, export, hash, fg, bg) run in the shell after every
+// earlier line has finished, so later lines see what they did.
+
+typedef struct script_worker_t {
+	pid_t pid;
+	int out_fd, err_fd; // captured stdout/stderr, -1 if not captured
+	int status; // exit status of the line
+	bool done;
+} script_worker_t;
+
+static bool is_barrier_line(cmd_t *cmd) {
+	return cmd->next == NULL &&
+		(cmd->builtin == BUILTIN_WAIT || cmd->builtin == BUILTIN_CD || cmd->builtin == BUILTIN_EXIT ||
+		cmd->builtin == BUILTIN_EXPORT || cmd->builtin == BUILTIN_HASH || cmd->builtin == BUILTIN_FG ||
+		cmd->builtin == BUILTIN_BG);
+}
+
+static void worker_start(script_worker_t *w, cmd_t *cmd) {
+	w->out_fd = memfd_create("slash-stdout", MFD_CLOEXEC);
+	w->err_fd = memfd_create("slash-stderr", MFD_CLOEXEC);
+	w->done = false;
+	w->pid = fork_child(STDIN_FILENO, w->out_fd != -1 ? w->out_fd : STDOUT_FILENO, -1, false);
+	if (w->pid == 0) {
+		if (w->err_fd != -1)
+			dup2(w->err_fd, STDERR_FILENO);
+		// lines running side by side must not fight over the terminal
+		job_control = false;
+		interactive = false;
+		process_command(cmd);
+		fflush(stdout);
+		fflush(stderr);
+		_exit(last_status);
+	}
+	if (w->pid == -1) {
+		perror("fork");
+		w->status = 127;
+		w->done = true;
+	}
+}
+
+// Copies a finished line's output to the shell's stdout/stderr.
+static void worker_emit(script_worker_t *w) {
+	int fds[2] = { w->out_fd, w->err_fd };
+	for (int i = 0; i < 2; i++) {
+		if (fds[i] == -1)
+			continue;
+		if (lseek(fds[i], 0, SEEK_SET) == 0)
+			copy_fd(fds[i], i == 0 ? STDOUT_FILENO : STDERR_FILENO);
+		close(fds[i]);
+	}
+}
 
-		if (cmd->redirects[1]){ // for the > case
+// Runs the script with up to max_jobs lines at a time. Returns the exit status
+// of the first line (in script order) that failed, 0 if all of them succeeded.
+int run_script_parallel(char *file_name, int max_jobs) {
+	script_t script;
+	if (!script_load(&script, file_name)) {
+		fprintf(stderr, "%s: %s\n", file_name, strerror(errno));
+		return 127;
+	}
 
-			int fd = open(cmd->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, // Open the file for writing, if it doesn't exist create a new file, if it exists delete it -> overwrite it
-				FILE_MODE); // Create file permissions: user read and write, group read, other read
-		 
-			if (fd == -1){ // open() failed
-				printf("ERROR! : Problem about output redirection (>)");
-				exit(1);
+	running_script = true;
+	script_worker_t *workers = calloc(script.line_count + 1, sizeof(script_worker_t));
+	int result = 0;
+	int group_start = 0;
+
+	while (group_start < script.line_count) {
+		int group_end = group_start;
+		while (group_end < script.line_count && !is_barrier_line(script.lines[group_end]))
+			group_end++;
+
+		// SIGCHLD stays blocked while the workers run: we reap them ourselves here,
+		// the handler would not know their pids.
+		sigset_t old_mask;
+		block_sigchld(&old_mask);
+		fflush(stdout);
+		int next_start = group_start, next_emit = group_start, running = 0;
+		while (next_emit < group_end) {
+			while (running < max_jobs && next_start < group_end) {
+				worker_start(&workers[next_start], script.lines[next_start]);
+				if (!workers[next_start].done)
+					running++;
+				next_start++;
 			}
 
-			dup2(fd, STDOUT_FILENO); // redirect stdout  to the file
-			close(fd); // close file descriptor 
-		}
+			if (running > 0) {
+				int status;
+				pid_t pid = waitpid(-1, &status, 0);
+				for (int i = group_start; pid > 0 && i < next_start; i++) {
+					if (workers[i].pid == pid && !workers[i].done) {
+						workers[i].status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+						workers[i].done = true;
+						running--;
+						break;
+					}
+				}
+				if (pid == -1 && errno == ECHILD) { // lost track of them, do not wait forever
+					for (int i = group_start; i < next_start; i++)
+						if (!workers[i].done) {
+							workers[i].status = 127;
+							workers[i].done = true;
+						}
+					running = 0;
+				}
+			}
 
-		if (cmd->redirects[2]){ // for the >> case
-			int fd = open(cmd->redirects[2], O_WRONLY | O_CREAT | O_APPEND, // Open the file for writing, if it doesn't exist create a new file, if it exists append to existing file			
-			FILE_MODE); // Create file permissions: user read and write, group read, other read
-		 
-			if (fd == -1){ // open() failed
-				printf("ERROR! : Problem about append redirection (>>)");
-				exit(1);
+			while (next_emit < next_start && workers[next_emit].done) {
+				worker_emit(&workers[next_emit]);
+				if (result == 0)
+					result = workers[next_emit].status;
+				next_emit++;
 			}
+		}
+		restore_sigmask(&old_mask);
 
-			dup2(fd, STDOUT_FILENO); // redirect stdout  to the file
-			close(fd); // close file descriptor 
+		if (group_end < script.line_count) { // the barrier itself runs in the shell
+			process_command(script.lines[group_end]);
+			group_end++;
 		}
+		group_start = group_end;
+	}
 
-		
+	free(workers);
+	return result;
+}
 
-		// TODO: implement exec for the resolved path using execv()
-		// execvp(cmd->name, cmd->args); // <- DO NOT USE THIS, replace it with execv()
-		
-		execv(path_to_execute, cmd->args); // Loads the located file into the child process for execution.
+// Server mode (slash --serve <socket> [workers]). The server listens on a Unix
+// socket and forks its workers up front. Each worker warms up its PATH cache and
+// builtin table and then accepts connections on the shared socket itself, so the
+// kernel hands every new connection to an idle worker and no request pays for a
+// shell startup. Every connection is served by a fork of its warmed-up worker,
+// so what one client does to the shell (export, cd, jobs) is gone when it
+// disconnects and the next one starts from the same clean state. A connection
+// carries newline-separated command lines; each is run with process_command(),
+// stdout and stderr captured in two fresh memfds, and answered with a header line
+//   status=<n> real=<s> user=<s> sys=<s> stdout=<bytes> stderr=<bytes>
+// followed by exactly that many bytes of stdout, then of stderr. user and sys
+// include the command's children. A background job (&) writes to /dev/null, it
+// would otherwise outlive its reply. A request cut off by the end of the stream
+// (no newline, an unterminated here-document) is answered with status=2 and an
+// error on stderr. exit is answered like any other request (status 0), then the
+// connection is closed. A worker that dies is replaced.
+
+static volatile sig_atomic_t serve_stopping = 0;
+
+static void serve_stop(int sig) {
+	(void)sig;
+	serve_stopping = 1;
+}
 
-        // if exec fails print error message
-		printf("ERROR! : Failed to execute command: %s\n", cmd->name);
-        // normally you should never reach here
-        exit(-1);
+// Sends len bytes, without SIGPIPE if the client went away.
+static bool serve_send(int sock, const void *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data = (const char *)data + n;
+		len -= n;
+	}
+	return true;
+}
 
-	} else {
-        // PARENT
+// Sends what a command wrote to a capture memfd.
+static bool serve_send_capture(int sock, int fd, size_t len) {
+	bool sent = true;
+	if (len > 0) {
+		void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+		sent = serve_send(sock, data, len);
+		munmap(data, len);
+	}
+	return sent;
+}
+
+// Answers a request that could not be run with status 2 and message on stderr.
+static bool serve_error(int sock, const char *message) {
+	char header[256];
+	int header_len = snprintf(header, sizeof(header), "status=2 real=0.000000 user=0.000000 sys=0.000000 stdout=0 stderr=%zu\n",
+		strlen(message));
+	return serve_send(sock, header, header_len) && serve_send(sock, message, strlen(message));
+}
+
+// Runs one request and answers it. Returns false if the client is gone.
+static bool serve_request(int sock, cmd_t *cmd, arena_t *arena) {
+	// fresh memfds for every request: nothing an earlier command left running
+	// can write into this reply
+	int capture[2] = { memfd_create("slash-stdout", MFD_CLOEXEC), memfd_create("slash-stderr", MFD_CLOEXEC) };
+	if (capture[0] == -1 || capture[1] == -1) {
+		for (int i = 0; i < 2; i++)
+			if (capture[i] != -1)
+				close(capture[i]);
+		arena_reset(arena);
+		return serve_error(sock, "slash: cannot capture output\n");
+	}
+	int null_fd = cmd->background ? open("/dev/null", O_WRONLY | O_CLOEXEC) : -1;
+
+	fflush(stdout);
+	fflush(stderr);
+	int saved_fds[2];
+	for (int i = 0; i < 2; i++) {
+		saved_fds[i] = fcntl(STDOUT_FILENO + i, F_DUPFD_CLOEXEC, 10);
+		dup2(null_fd != -1 ? null_fd : capture[i], STDOUT_FILENO + i);
+	}
+
+	struct timespec started, ended;
+	struct rusage self, self_before, children, children_before;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+	getrusage(RUSAGE_SELF, &self_before);
+	getrusage(RUSAGE_CHILDREN, &children_before);
+
+	// builtin_exit() would end the process before the reply is sent
+	bool exiting = cmd->builtin == BUILTIN_EXIT;
+	last_status = 0;
+	if (!exiting)
+		process_command(cmd);
+	arena_reset(arena);
+	jobs_notify(); // frees finished background jobs
+	fflush(stdout);
+	fflush(stderr);
+
+	clock_gettime(CLOCK_MONOTONIC, &ended);
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	rusage_sub(&self, &self_before);
+	rusage_sub(&children, &children_before);
+	rusage_add(&self, &children);
+
+	for (int i = 0; i < 2; i++) {
+		dup2(saved_fds[i], STDOUT_FILENO + i);
+		close(saved_fds[i]);
+	}
+	if (null_fd != -1)
+		close(null_fd);
+
+	off_t sizes[2] = { lseek(capture[0], 0, SEEK_CUR), lseek(capture[1], 0, SEEK_CUR) };
+	char header[256];
+	int header_len = snprintf(header, sizeof(header), "status=%d real=%.6f user=%.6f sys=%.6f stdout=%lld stderr=%lld\n",
+		last_status, timespec_seconds(&started, &ended), timeval_seconds(self.ru_utime),
+		timeval_seconds(self.ru_stime), (long long)sizes[0], (long long)sizes[1]);
+	bool sent = serve_send(sock, header, header_len);
+	for (int i = 0; i < 2; i++) {
+		sent = serve_send_capture(sock, capture[i], sizes[i]) && sent;
+		close(capture[i]);
+	}
+	return sent && !exiting;
+}
+
+// Answers the requests of one connection until the client closes it.
+static void serve_connection(int sock, arena_t *arena) {
+	size_t capacity = STREAM_CHUNK, len = 0;
+	char *buf = malloc(capacity);
+	bool open = true;
+	while (open) {
+		if (capacity - len < STREAM_CHUNK / 2) {
+			capacity *= 2;
+			buf = realloc(buf, capacity);
+		}
+		ssize_t n = read(sock, buf + len, capacity - len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+
+		size_t pos = 0, used;
+		char *nl;
+		while (open && (nl = memchr(buf + pos, '\n', len - pos)) != NULL) {
+			cmd_t *cmd = parse_line(buf + pos, nl - (buf + pos), arena);
+			size_t next = nl - buf + 1;
+			if (!heredoc_read(cmd, buf + next, len - next, false, &used, arena)) {
+				arena_reset(arena);
+				break; // wait for the rest of the here-document
+			}
+			open = serve_request(sock, cmd, arena);
+			pos = next + used;
+		}
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+	}
+	if (open && len > 0) // the client closed its side in the middle of a request
+		serve_error(sock, "slash: incomplete request at end of input\n");
+	free(buf);
+}
+
+static void serve_worker(int listen_fd, int home_fd) {
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	int null_fd = open("/dev/null", O_RDONLY);
+	dup2(null_fd, STDIN_FILENO); // commands must not read the server's stdin
+	close(null_fd);
+	fchdir(home_fd);
+	running_script = true;
+
+	// warm up: the PATH directories and the builtin table are ready before the first request
+	char *path_env = getenv("PATH");
+	if (path_env != NULL)
+		path_cache_sync(path_env);
+	builtin_lookup("");
+	arena_t arena = { 0 };
+
+	while (1) {
+		int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			_exit(1);
+		}
+		// the connection gets its own copy of the warm shell, the worker itself
+		// never runs a command and stays clean for the next client
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(listen_fd);
+			jobs_init(); // the job table and SIGCHLD handler belong to the connection
+			serve_connection(sock, &arena);
+			fflush(stdout);
+			_exit(0);
+		}
+		if (pid == -1)
+			serve_error(sock, "slash: cannot fork\n");
+		close(sock);
+		while (pid > 0 && waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+}
+
+// Serves requests on socket_path with a pool of workers until SIGINT or SIGTERM.
+int serve(const char *socket_path, int worker_count) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", socket_path);
+		return 2;
+	}
+	strcpy(addr.sun_path, socket_path);
 
-        wait(0); // wait for child process to finish		
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(socket_path); // left over from an earlier server
+	if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 128) == -1) {
+		fprintf(stderr, "%s: %s\n", socket_path, strerror(errno));
+		return 1;
+	}
+	int home_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_stop; // no SA_RESTART: waitpid() below has to return
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pid_t *workers = calloc(worker_count, sizeof(pid_t));
+	while (!serve_stopping) {
+		for (int i = 0; i < worker_count; i++) {
+			if (workers[i] != 0)
+				continue;
+			fflush(stdout);
+			workers[i] = fork();
+			if (workers[i] == 0)
+				serve_worker(listen_fd, home_fd);
+			if (workers[i] == -1) {
+				perror("fork");
+				workers[i] = 0;
+			}
+		}
+		pid_t pid = waitpid(-1, NULL, 0);
+		for (int i = 0; pid > 0 && i < worker_count; i++)
+			if (workers[i] == pid)
+				workers[i] = 0;
+		if (pid == -1 && errno == ECHILD)
+			sleep(1); // no worker could be started, do not spin
 	}
 
+	for (int i = 0; i < worker_count; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+		;
+	unlink(socket_path);
+	free(workers);
+	return 0;
 }